@@ -0,0 +1,153 @@
+// B+-tree from 64 bit keys to values, the ordered index the store keeps next to its hash table so keys can be
+// walked in key order
+//
+// Keys are never removed, so the tree only grows: an insert goes down to its leaf and a full node splits on the way
+// back up, the root growing a level when it splits. Nodes are btreeFanout keys wide, a leaf is one sorted run of
+// keys and values, and leaves are linked left to right so a range is read leaf after leaf without going back up.
+// The tree is not thread safe, its owner serializes inserts with reads.
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+const int btreeFanout = 64;
+
+template <typename Value>
+struct BTree {
+    struct Node {
+        bool leaf;
+        int count;
+        uint64_t keys[btreeFanout];
+    };
+
+    struct Leaf : Node {
+        Value values[btreeFanout];
+        Leaf *next;
+    };
+
+    // Child i holds the keys below keys[i], the last child the keys from keys[count - 1] up
+    struct Inner : Node {
+        Node *children[btreeFanout + 1];
+    };
+
+    Node *root;
+    size_t count;
+
+    BTree() : root(newLeaf()), count(0) {}
+
+    ~BTree() { release(root); }
+
+    BTree(const BTree &) = delete;
+    BTree &operator=(const BTree &) = delete;
+
+    // Add a key, or set its value if it is already in the tree
+    void insert(uint64_t key, const Value &value) {
+        uint64_t separator;
+        Node *split = insert(root, key, value, &separator);
+        if (split) {
+            Inner *grown = new Inner();
+            grown->leaf = false;
+            grown->count = 1;
+            grown->keys[0] = separator;
+            grown->children[0] = root;
+            grown->children[1] = split;
+            root = grown;
+        }
+    }
+
+    // Leaf holding the first key at or after key, and the position of that key in it, NULL if there is none
+    Leaf *lowerBound(uint64_t key, int *position) const {
+        Node *node = root;
+        while (!node->leaf) {
+            Inner *inner = (Inner *)node;
+            node = inner->children[std::upper_bound(inner->keys, inner->keys + inner->count, key) - inner->keys];
+        }
+        Leaf *leaf = (Leaf *)node;
+        *position = std::lower_bound(leaf->keys, leaf->keys + leaf->count, key) - leaf->keys;
+        while (leaf && *position == leaf->count) {
+            leaf = leaf->next;
+            *position = 0;
+        }
+        return leaf;
+    }
+
+private:
+    static Leaf *newLeaf() {
+        Leaf *leaf = new Leaf();
+        leaf->leaf = true;
+        leaf->count = 0;
+        leaf->next = NULL;
+        return leaf;
+    }
+
+    // Insert below node, return the new right sibling if node split and set separator to its first key
+    Node *insert(Node *node, uint64_t key, const Value &value, uint64_t *separator) {
+        if (node->leaf) {
+            Leaf *leaf = (Leaf *)node;
+            int position = std::lower_bound(leaf->keys, leaf->keys + leaf->count, key) - leaf->keys;
+            if (position < leaf->count && leaf->keys[position] == key) {
+                leaf->values[position] = value;
+                return NULL;
+            }
+            std::copy_backward(leaf->keys + position, leaf->keys + leaf->count, leaf->keys + leaf->count + 1);
+            std::copy_backward(leaf->values + position, leaf->values + leaf->count, leaf->values + leaf->count + 1);
+            leaf->keys[position] = key;
+            leaf->values[position] = value;
+            leaf->count++;
+            count++;
+            if (leaf->count < btreeFanout) {
+                return NULL;
+            }
+            // Full: the upper half moves to a new leaf
+            Leaf *right = newLeaf();
+            int keep = btreeFanout / 2;
+            right->count = leaf->count - keep;
+            std::copy(leaf->keys + keep, leaf->keys + leaf->count, right->keys);
+            std::copy(leaf->values + keep, leaf->values + leaf->count, right->values);
+            leaf->count = keep;
+            right->next = leaf->next;
+            leaf->next = right;
+            *separator = right->keys[0];
+            return right;
+        }
+        Inner *inner = (Inner *)node;
+        int child = std::upper_bound(inner->keys, inner->keys + inner->count, key) - inner->keys;
+        uint64_t childSeparator;
+        Node *split = insert(inner->children[child], key, value, &childSeparator);
+        if (!split) {
+            return NULL;
+        }
+        std::copy_backward(inner->keys + child, inner->keys + inner->count, inner->keys + inner->count + 1);
+        std::copy_backward(inner->children + child + 1, inner->children + inner->count + 1,
+                           inner->children + inner->count + 2);
+        inner->keys[child] = childSeparator;
+        inner->children[child + 1] = split;
+        inner->count++;
+        if (inner->count < btreeFanout) {
+            return NULL;
+        }
+        // Full: the middle key moves up, the keys and children after it move to a new node
+        Inner *right = new Inner();
+        right->leaf = false;
+        int middle = btreeFanout / 2;
+        right->count = inner->count - middle - 1;
+        std::copy(inner->keys + middle + 1, inner->keys + inner->count, right->keys);
+        std::copy(inner->children + middle + 1, inner->children + inner->count + 1, right->children);
+        *separator = inner->keys[middle];
+        inner->count = middle;
+        return right;
+    }
+
+    void release(Node *node) {
+        if (node->leaf) {
+            delete (Leaf *)node;
+            return;
+        }
+        Inner *inner = (Inner *)node;
+        for (int i = 0; i <= inner->count; i++) {
+            release(inner->children[i]);
+        }
+        delete inner;
+    }
+};
@@ -1 +1 @@
-g++ -pthread -o server main.cpp -std=c++11 -fnon-call-exceptions 
\ No newline at end of file
+make server
@@ -1,7 +1,12 @@
 /*
 Sample commands:-
-For read:- ./client [server key]
-For write:- ./client [server key] [message]
+For read:- ./client [key]
+For write:- ./client [key] [message]
+For batch read:- ./client mget [key] [key] ...
+For batch write:- ./client mset [key] [message] [key] [message] ...
+For range scan:- ./client scan [start key] [end key] [limit]   (keys in key order, limit optional)
+For benchmark:- ./client bench [option=value] ... (see benchUsage)
+For server metrics:- ./client stats [server number]
 */
 
 #include <iostream> 
@@ -14,64 +19,52 @@ For write:- ./client [server key] [message]
 #include <array>         // For array operations
 #include <unistd.h>      // For POSIX system calls, used to invoke sleep and usleep
 #include <chrono>        // clock to seed for random value
+#include <thread>        // Benchmark threads
+#include <random>        // Benchmark key and operation generators
+#include <cmath>         // Zipfian generator
+#include <algorithm>     // min of value and prefix sizes
+
+#include "client.h"      // Client library: cached connections, routing, failover and hedged reads
+#include "cluster.h"     // Servers and the hash ring placing keys on them
+#include "failure.h"     // Deadline bounded connects and the servers known to be down
+#include "histogram.h"   // Benchmark latency histograms
+
+#include "protocol.h"    // Frames shared with the server
 
 using namespace std;
 
-#define PORT 4430
 #define YELLOW "\033[1;33m"   // Yellow
 #define GREEN "\033[32m"      // Green
 #define RED "\033[31m"        // Red
 #define RESET "\033[0m"       // RESET
 
+ClusterConfig cluster;
+HashRing ring;
+// Servers down as seen by legacy mode requests, frame requests go through KvClient
+FailureDetector serverHealth(clientRetryDownMs);
+
+// Load the servers and build the ring, the same way the servers do
 vector<string> readConfig(const string &filename) {
-    vector<string> config; 
-    ifstream file(filename);
-    if(!file){
+    if(!loadClusterConfig(filename, cluster)){
         cout<<"File not found"<<endl;
         exit(1);
     }
-    string line;
-    while(getline(file, line)) {
-        config.push_back(line.substr(line.find('=') + 1));
-    }
-    file.close();
-    return config;
-}
-
-// 0 will be received if no value found
-void readMessage(int serverSocket, array<unsigned short int, 3> msg) {
-    unsigned short int buffer;
-    ssize_t bytesRead = recv(serverSocket, &buffer, sizeof(buffer), 0);
-    if (bytesRead == -1) {
-        cout<<RED<<"Read failed"<<RESET<<endl;
-    } else if (bytesRead == 0) {
-        cout<<"Connection closed by peer"<<endl;
-    } else {
-        if(msg[0] == 1){
-            cout<<GREEN<<"Received value for key "<<RESET<<msg[1]<<" = "<<buffer<<endl;
-        } else {
-            if(buffer == 1){
-                cout<<GREEN<<"Write acknowledgement received for "<<RESET<<msg[1]<<GREEN<<" with value "<<RESET<<msg[2]<<endl;
-            } else {
-                cout<<RED<<"Write failed at server side for "<<RESET<<msg[1]<<RED<<" with value "<<RESET<<msg[2]<<endl;
-            }
-        }
-    }
-    close(serverSocket);
+    ring.build(cluster);
+    return cluster.hosts;
 }
 
+// Connect to a server, failing over right away if it is known to be down or does not answer in time
 int sendConnectionRequests(string serverIP, int serverId) {
-    struct sockaddr_in targetServerAddress;
-    targetServerAddress.sin_family = AF_INET;
-    targetServerAddress.sin_addr.s_addr = inet_addr(serverIP.c_str());
-    targetServerAddress.sin_port = htons(PORT);
-    int targetSocket = socket(AF_INET, SOCK_STREAM, 0);
-    // special feature for immediate reuse of port
-    // int opt = 1;
-    // setsockopt(targetSocket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-    if(connect(targetSocket, (const struct sockaddr*)&targetServerAddress, sizeof(targetServerAddress)) < 0){
-        targetSocket = 0;
+    if(serverHealth.isDown(serverId)) {
+        return 0;
+    }
+    int targetSocket = connectWithDeadline(serverIP, cluster.ports[serverId], clientConnectTimeoutMs);
+    if(targetSocket < 0) {
+        serverHealth.failed(serverId);
+        return 0;
     }
+    serverHealth.heard(serverId);
+    setSocketDeadline(targetSocket, clientRequestTimeoutMs);
     return targetSocket;
 }
 
@@ -96,6 +89,298 @@ int getServerId(const vector<int>& arr, const vector<int>& used) {
     return remaining[idx];
 }
 
+/*
+failover order for a key:-
+->read: the servers holding the key in random order
+->write: the server owning the key on the ring, then the next replica
+*/
+int connectForKey(const vector<string> &serverIPs, uint64_t key, bool read, int &serverId) {
+    const int *replicas = ring.replicas(key);
+    vector<int> arr(replicas, replicas + ring.replicaCount);
+    vector<int> used;
+    int retries = read ? ring.replicaCount : min(2, ring.replicaCount);
+    serverId = read ? getServerId(arr, used) : arr[0];
+    for(int i=0; i<retries; i++) {
+        int serverSocket = sendConnectionRequests(serverIPs[serverId], serverId);
+        if(serverSocket > 0) {
+            return serverSocket;
+        }
+        if(read) {
+            used.push_back(serverId);
+            serverId = getServerId(arr, used);
+        } else {
+            serverId = arr[(i + 1) % arr.size()];
+        }
+    }
+    return 0;
+}
+
+// Print the results of a batch read or write, one line per key
+int batchRequest(KvClient &client, bool write, const vector<uint64_t> &keys, const vector<string> &values) {
+    vector<KvResult> results = write ? client.multiPut(keys, values).get() : client.multiGet(keys).get();
+    for(size_t i=0; i<keys.size(); i++) {
+        if(results[i].server < 0) {
+            cout<<RED<<"Connections to all servers of replica set "<<RESET<<client.hashRing().replicaSetOf(keys[i]) + 1<<RED<<" failed for key "<<RESET<<keys[i]<<endl;
+        } else if(!write) {
+            cout<<GREEN<<"Received value for key "<<RESET<<keys[i]<<" = "<<results[i].value<<endl;
+        } else if(results[i].ok) {
+            cout<<GREEN<<"Write acknowledgement received for "<<RESET<<keys[i]<<GREEN<<" with value "<<RESET<<values[i]<<endl;
+        } else {
+            cout<<RED<<"Write failed at server side for "<<RESET<<keys[i]<<RED<<" with value "<<RESET<<values[i]<<endl;
+        }
+    }
+    return 0;
+}
+
+// Ask a server for its metrics report
+int printStats(KvClient &client, int serverId) {
+    if(serverId < 0 || serverId >= (int)cluster.hosts.size()) {
+        cout<<RED<<"Invalid server"<<RESET<<endl;
+        return 1;
+    }
+    KvResult result = client.stats(serverId).get();
+    if(!result.ok) {
+        cout<<RED<<"Stats request to server "<<RESET<<serverId + 1<<RED<<" failed"<<RESET<<endl;
+        return 1;
+    }
+    cout<<result.value;
+    return 0;
+}
+
+// Print the keys from start to end in key order, a page at a time, up to limit keys or all of them if 0
+int printScan(KvClient &client, uint64_t start, uint64_t end, uint64_t limit) {
+    uint64_t printed = 0;
+    int pages = 0;
+    while(limit == 0 || printed < limit) {
+        KvScanPage page = client.scan(start, end, limit == 0 ? 0 : min<uint64_t>(limit - printed, scanMaxKeys)).get();
+        if(!page.ok) {
+            cout<<RED<<"Scan failed from key "<<RESET<<start<<endl;
+            return 1;
+        }
+        pages++;
+        for(size_t i=0; i<page.entries.size() && (limit == 0 || printed < limit); i++, printed++) {
+            cout<<page.entries[i].first<<" = "<<page.entries[i].second<<endl;
+        }
+        if(!page.more) {
+            break;
+        }
+        start = page.next;
+    }
+    cout<<GREEN<<"Scanned "<<RESET<<printed<<GREEN<<" keys in "<<RESET<<pages<<GREEN<<" pages"<<RESET<<endl;
+    return 0;
+}
+
+/*
+benchmark mode:-
+->every thread runs its own operations, keys and read/write mix are drawn from its own generator
+->closed loop (rate=0): a thread sends its next operation when the previous one is answered
+->open loop (rate>0): operations are scheduled at the target rate, latency counts from the scheduled time
+->frame mode runs every thread through one shared KvClient, its connections, replica choice and hedging, legacy mode
+  opens a connection per operation
+->read_level and write_level set the consistency level of frame mode operations, default leaves it to the server
+->results are printed as one JSON object
+*/
+struct BenchOptions {
+    int threads = 4;
+    double seconds = 10;
+    double readRatio = 0.9;
+    string distribution = "uniform";
+    double theta = 0.99;
+    double rate = 0;  // total operations per second, 0 for closed loop
+    uint64_t keys = 65535;
+    int valueSize = 8;
+    string mode = "frame";
+    string readLevel = "default";
+    string writeLevel = "default";
+};
+
+// Consistency level named on the command line, -1 if the name is unknown
+int parseConsistency(const string &name) {
+    if(name == "default") return CONSISTENCY_DEFAULT;
+    if(name == "one") return CONSISTENCY_ONE;
+    if(name == "quorum") return CONSISTENCY_QUORUM;
+    if(name == "all") return CONSISTENCY_ALL;
+    return -1;
+}
+
+void benchUsage() {
+    cout<<"Usage: ./client bench [threads=4] [seconds=10] [reads=0.9] [dist=uniform|zipf] [theta=0.99] [rate=0] [keys=65535] [size=8] [mode=frame|legacy]"
+        <<" [read_level=default|one|quorum|all] [write_level=default|one|quorum|all]"<<endl;
+    cout<<"size: bytes per written value in frame mode, legacy mode writes 16 bit values to keys up to 65535"<<endl;
+}
+
+// Zipfian ranks over 1..n (Gray et al.), rank 1 is the most popular
+struct ZipfGenerator {
+    double n, theta, alpha, zetan, eta;
+    ZipfGenerator(uint64_t items, double skew) : n(items), theta(skew) {
+        zetan = 0;
+        for(uint64_t i=1; i<=items; i++) {
+            zetan += 1.0 / pow(i, theta);
+        }
+        double zeta2 = 1 + 1.0 / pow(2, theta);
+        alpha = 1.0 / (1.0 - theta);
+        eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zetan);
+    }
+    uint64_t next(double u) const {
+        double uz = u * zetan;
+        if(uz < 1) {
+            return 1;
+        }
+        if(uz < 1 + pow(0.5, theta)) {
+            return 2;
+        }
+        return 1 + (uint64_t)(n * pow(eta * u - eta + 1, alpha));
+    }
+};
+
+struct BenchThreadResult {
+    LatencyHistogram reads;
+    LatencyHistogram writes;
+    uint64_t errors = 0;
+    uint64_t hedged = 0;
+};
+
+// One operation through the client library, set hedged if a read was sent twice
+bool benchFrameOperation(KvClient &client, uint64_t key, bool read, const string &value, bool *hedged, int consistency) {
+    KvResult result = read ? client.get(key, consistency).get() : client.put(key, value, consistency).get();
+    *hedged = result.hedged;
+    return result.ok;
+}
+
+// One operation over a new connection, like a single ./client call
+bool benchLegacyOperation(const vector<string> &serverIPs, uint64_t key, bool read, unsigned short int value) {
+    int serverId;
+    int serverSocket = connectForKey(serverIPs, key, read, serverId);
+    if(serverSocket <= 0) {
+        return false;
+    }
+    unsigned short int msg[3] = {(unsigned short int)(read ? READ_REQUEST : WRITE_REQUEST), (unsigned short int)key, value};
+    unsigned short int buffer = 0;
+    bool ok = send(serverSocket, msg, sizeof(msg), MSG_NOSIGNAL) == sizeof(msg) &&
+              recv(serverSocket, &buffer, sizeof(buffer), MSG_WAITALL) == sizeof(buffer) && (read || buffer == 1);
+    close(serverSocket);
+    return ok;
+}
+
+void benchThread(const vector<string> &serverIPs, KvClient *client, const BenchOptions &options, const ZipfGenerator *zipf, int index,
+                 chrono::steady_clock::time_point start, chrono::steady_clock::time_point end, BenchThreadResult *result) {
+    mt19937_64 random(chrono::steady_clock::now().time_since_epoch().count() + index * 7919);
+    uniform_real_distribution<double> unit(0.0, 1.0);
+    // Open loop: each thread takes an equal share of the target rate, its first operation is staggered
+    chrono::nanoseconds interval(options.rate > 0 ? (long long)(1e9 * options.threads / options.rate) : 0);
+    chrono::steady_clock::time_point scheduled = start + interval * index / options.threads;
+    string value(options.valueSize, 'v');
+    while(true) {
+        if(options.rate > 0) {
+            if(scheduled >= end) {
+                break;
+            }
+            this_thread::sleep_until(scheduled);
+        } else {
+            scheduled = chrono::steady_clock::now();
+            if(scheduled >= end) {
+                break;
+            }
+        }
+        uint64_t key;
+        if(zipf) {
+            // Scramble ranks so the hottest keys spread over every replica set
+            uint64_t rank = zipf->next(unit(random));
+            key = (rank * 0x9E3779B97F4A7C15ULL >> 24) % options.keys + 1;
+        } else {
+            key = random() % options.keys + 1;
+        }
+        bool read = unit(random) < options.readRatio;
+        unsigned short int legacyValue = (unsigned short int)(random() % 65535) + 1;  // on write value cant be zero
+        // The value is mostly filler, with a changing prefix so each write differs
+        value.replace(0, min(value.size(), sizeof(legacyValue)), (const char *)&legacyValue, min(value.size(), sizeof(legacyValue)));
+        bool hedged = false;
+        bool ok = options.mode == "legacy" ? benchLegacyOperation(serverIPs, key, read, legacyValue)
+                                           : benchFrameOperation(*client, key, read, value, &hedged,
+                                                                 parseConsistency(read ? options.readLevel : options.writeLevel));
+        uint64_t latency = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - scheduled).count();
+        if(!ok) {
+            result->errors++;
+        }
+        if(hedged) {
+            result->hedged++;
+        }
+        (read ? result->reads : result->writes).record(latency);
+        scheduled += interval;
+    }
+}
+
+int benchmark(const vector<string> &serverIPs, KvClient &client, int argc, char* argv[]) {
+    BenchOptions options;
+    for(int i=2; i<argc; i++) {
+        string arg = argv[i];
+        size_t eq = arg.find('=');
+        if(eq == string::npos) {
+            benchUsage();
+            return 1;
+        }
+        string name = arg.substr(0, eq), value = arg.substr(eq + 1);
+        if(name == "threads") options.threads = stoi(value);
+        else if(name == "seconds") options.seconds = stod(value);
+        else if(name == "reads") options.readRatio = stod(value);
+        else if(name == "dist") options.distribution = value;
+        else if(name == "theta") options.theta = stod(value);
+        else if(name == "rate") options.rate = stod(value);
+        else if(name == "keys") options.keys = stoull(value);
+        else if(name == "size") options.valueSize = stoi(value);
+        else if(name == "mode") options.mode = value;
+        else if(name == "read_level") options.readLevel = value;
+        else if(name == "write_level") options.writeLevel = value;
+        else {
+            benchUsage();
+            return 1;
+        }
+    }
+    if(options.threads < 1 || options.keys < 1 || options.valueSize < 0 || options.valueSize > (int)maxValueLength ||
+       (options.distribution != "uniform" && options.distribution != "zipf") || (options.mode != "frame" && options.mode != "legacy") ||
+       (options.mode == "legacy" && options.keys > 65535) || parseConsistency(options.readLevel) < 0 ||
+       parseConsistency(options.writeLevel) < 0) {
+        benchUsage();
+        return 1;
+    }
+    ZipfGenerator *zipf = options.distribution == "zipf" ? new ZipfGenerator(options.keys, options.theta) : NULL;
+
+    vector<BenchThreadResult *> results;
+    vector<thread> threads;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now() + chrono::milliseconds(10);
+    chrono::steady_clock::time_point end = start + chrono::nanoseconds((long long)(options.seconds * 1e9));
+    for(int i=0; i<options.threads; i++) {
+        results.push_back(new BenchThreadResult());
+        threads.push_back(thread(benchThread, cref(serverIPs), &client, cref(options), zipf, i, start, end, results[i]));
+    }
+    for(auto &t : threads) {
+        t.join();
+    }
+    double elapsed = chrono::duration_cast<chrono::duration<double> >(chrono::steady_clock::now() - start).count();
+
+    LatencyHistogram reads, writes, all;
+    uint64_t errors = 0, hedged = 0;
+    for(auto result : results) {
+        reads.merge(result->reads);
+        writes.merge(result->writes);
+        all.merge(result->reads);
+        all.merge(result->writes);
+        errors += result->errors;
+        hedged += result->hedged;
+        delete result;
+    }
+    delete zipf;
+    uint64_t operations = all.total;
+    printf("{\"mode\": \"%s\", \"threads\": %d, \"seconds\": %.2f, \"distribution\": \"%s\", \"theta\": %.2f, "
+           "\"read_ratio\": %.2f, \"target_rate\": %.0f, \"keys\": %llu, \"value_size\": %d, \"operations\": %llu, \"errors\": %llu, "
+           "\"read_level\": \"%s\", \"write_level\": \"%s\", \"hedged_reads\": %llu, \"throughput_ops\": %.1f, \"read\": %s, \"write\": %s, \"all\": %s}\n",
+           options.mode.c_str(), options.threads, elapsed, options.distribution.c_str(), options.theta, options.readRatio,
+           options.rate, (unsigned long long)options.keys, options.valueSize, (unsigned long long)operations, (unsigned long long)errors,
+           options.readLevel.c_str(), options.writeLevel.c_str(), (unsigned long long)hedged, operations / elapsed,
+           reads.json().c_str(), writes.json().c_str(), all.json().c_str());
+    return 0;
+}
+
  /*
 param 1 = ./client
 param 2 = action (read or write), it is needed to handle a few cases
@@ -115,69 +400,56 @@ new changes:-
 */
 int main(int argc, char* argv[]) {
     srand(chrono::duration_cast<chrono::microseconds>(chrono::high_resolution_clock::now().time_since_epoch()).count());
-    vector<string> serverIPs = readConfig("config.txt");
-    int serverSocket ,serverId, retries, value;
-    vector<int> arr = {0,0,0};
-    vector<int> used;
-    unsigned short int key;
-    array<unsigned short int, 3> msg = {0, 0, 0};
-    serverSocket = 0;
-    retries = (argc == 2) ? 3 : 2;
+    vector<string> serverIPs = readConfig(clusterConfigPath());
+    KvClient client(cluster);
+    if(argc > 1 && (string(argv[1]) == "mget" || string(argv[1]) == "mset")) {
+        bool write = string(argv[1]) == "mset";
+        vector<uint64_t> keys;
+        vector<string> values;
+        for(int i=2; i<argc; i+=(write ? 2 : 1)) {
+            keys.push_back(stoull(argv[i]));
+            values.push_back(write && i + 1 < argc ? argv[i + 1] : "");
+        }
+        return batchRequest(client, write, keys, values);
+    }
+    if((argc == 4 || argc == 5) && string(argv[1]) == "scan") {
+        return printScan(client, stoull(argv[2]), stoull(argv[3]), argc == 5 ? stoull(argv[4]) : 0);
+    }
+    if(argc == 3 && string(argv[1]) == "stats") {
+        return printStats(client, stoi(argv[2]) - 1);
+    }
+    if(argc > 1 && string(argv[1]) == "bench") {
+        return benchmark(serverIPs, client, argc, argv);
+    }
+    uint64_t key;
+    string value;
     if(argc == 2) {
-        key = stoi(argv[1]);
-        serverId = key % 7;
-        arr[0] = serverId;
-        arr[1] = serverId + 1;
-        arr[2] = serverId + 2;
-        serverId = getServerId(arr, used);
+        key = stoull(argv[1]);
     } else if(argc == 1) {
         key = (rand()%65535)+1;
-        value = rand()%65530;
-        serverId = key % 7;
+        value = to_string(rand()%65530);
     } else {
-        key = stoi(argv[1]);
-        value = stoi(argv[2]);
-        serverId = key % 7;
+        key = stoull(argv[1]);
+        value = argv[2];
     }
-    for(int i=0; i<retries; i++) {
-        serverSocket = sendConnectionRequests(serverIPs[serverId], serverId);
-        if(serverSocket > 0) {
-            cout<<"Connected to server "<<serverId + 1<<endl;
-            break;
+    if(argc == 2) {
+        // Reads go to the replicas directly, with a hedge if the first one is slow
+        KvResult result = client.get(key).get();
+        if(result.ok) {
+            cout<<GREEN<<"Received value for key "<<RESET<<key<<" = "<<result.value<<GREEN<<" from server "<<RESET<<result.server + 1<<(result.hedged ? " (hedged)" : "")<<endl;
         } else {
-            if(argc == 2) {
-                used.push_back(serverId);
-                serverId = getServerId(arr, used);
-            } else {
-                serverId = (key + i + 1) % 7;
-            } 
+            cout<<RED<<"Read failed on all applicable servers"<<RESET<<endl;
         }
-    }
-    if(serverSocket <= 0){
-        cout<<RED<<"Connections to all applicable servers failed"<<RESET<<endl;
         return 0;
     }
-    if(argc == 2) {
-        msg[0] = 1; // read
-        msg[1] = key;
-        size_t msgSize = sizeof(unsigned short int) * 3;
-        if(send(serverSocket, msg.data(), msgSize, 0) < 0){
-            cout<<RED<<"Failure while sending reading Request"<<RESET<<endl;
-        } else {
-            cout<<YELLOW<<"Request Sent to server "<<RESET<<serverId + 1<<YELLOW<<"!"<<RESET<<endl;
-            readMessage(serverSocket, msg);
-        }
+    // Writes go to the owner of the key, or to its next replica if the owner is down
+    KvResult result = client.put(key, value).get();
+    if(result.server < 0) {
+        cout<<RED<<"Connections to all applicable servers failed"<<RESET<<endl;
+    } else if(result.ok) {
+        cout<<GREEN<<"Write acknowledgement received for "<<RESET<<key<<GREEN<<" with value "<<RESET<<value<<GREEN<<" from server "<<RESET<<result.server + 1<<endl;
     } else {
-        msg[0] = 2; // write
-        msg[1] = key;
-        msg[2] = value;
-        size_t msgSize = sizeof(unsigned short int) * 3;
-        if(send(serverSocket, msg.data(), msgSize, 0) < 0){
-            cout<<RED<<"Write to Server "<<RESET<<serverId + 1<<RED<<" failed"<<RESET<<endl;
-        } else {
-            cout<<YELLOW<<"Write request sent with key "<<RESET<<msg[1]<<YELLOW<<" and msg "<<RESET<<msg[2]<<YELLOW<<" to server "<<RESET<<serverId + 1<<endl;
-            readMessage(serverSocket, msg);
-        }
+        cout<<RED<<"Write failed at server side for "<<RESET<<key<<RED<<" with value "<<RESET<<value<<endl;
     }
     return 0;
 }
@@ -0,0 +1,859 @@
+// Asynchronous client library: a long lived KvClient keeps one connection to every server it talks to and runs every
+// request of the process over them from a single epoll event loop thread, so thousands of operations can be in
+// flight without a connection or a thread each
+//
+// get, put, multiGet, multiPut and scan return a future, or take a callback run on the loop thread once the operation is
+// answered or has failed everywhere, a callback must not block. Requests are frames pipelined on the cached
+// connections and replies are matched by request id. Routing and failover stay inside the replica set of a key:
+// - a read goes to the better of two random replicas by latency (power of two choices), and if it is not answered
+//   by the hedge deadline of that replica, a high percentile of its latency, it is sent again to the fastest other
+//   replica and the first reply wins
+// - a write goes to the owner of the key, then to the next replica if the owner fails
+// - a batch is split by replica set into frames of up to clientBatchKeys keys, a frame that fails moves on to the
+//   next server of its set
+// - a scan page goes to any server, the fastest first, which reads the range from one holder of every replica set
+// A server that fails to connect or to answer in time is marked down, its requests move on to the next replica and
+// it is skipped for clientRetryDownMs.
+#pragma once
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "cluster.h"
+#include "failure.h"
+#include "histogram.h"
+#include "protocol.h"
+
+// Keys per MGET/MSET frame, larger batches are split into several pipelined frames
+const size_t clientBatchKeys = 1000;
+// Milliseconds a connect and a request may take, and a server that failed is skipped before it is tried again
+const int clientConnectTimeoutMs = 200;
+const int clientRequestTimeoutMs = 2000;
+const int clientRetryDownMs = 5000;
+// Reads still unanswered at this percentile of their replica's latency are sent again to another replica
+const double clientHedgePercentile = 95;
+// Hedge deadline bounds, the default is used until a replica has clientHedgeMinSamples replies
+const uint64_t clientHedgeMinMicros = 200;
+const uint64_t clientHedgeDefaultMicros = 10000;
+const uint64_t clientHedgeMinSamples = 32;
+// A replica not heard from for this long is tried again whatever its average, it may have recovered
+const int clientReplicaStaleMs = 1000;
+
+// Outcome of one key of an operation
+struct KvResult {
+    // A read was served, or a write acknowledged, by the replicas of its consistency level
+    bool ok = false;
+    // A read found the key, value holds it
+    bool found = false;
+    std::string value;
+    // Server that answered, -1 if none did
+    int server = -1;
+    // A read was sent to a second replica
+    bool hedged = false;
+};
+
+// One page of a scan, keys in order
+struct KvScanPage {
+    // Every replica set of the range was read
+    bool ok = false;
+    // Keys may follow the last one of the page, the next page starts at next
+    bool more = false;
+    uint64_t next = 0;
+    std::vector<std::pair<uint64_t, std::string> > entries;
+    int server = -1;
+};
+
+typedef std::function<void(KvResult &)> KvCallback;
+typedef std::function<void(std::vector<KvResult> &)> KvBatchCallback;
+typedef std::function<void(KvScanPage &)> KvScanCallback;
+
+// Latency of every server as seen by the loop thread: an EWMA to pick the replica of a read and a histogram for
+// its hedge deadline
+struct ReplicaTracker {
+    double ewmaNanos[maxHosts] = {};
+    int64_t lastHeard[maxHosts] = {};
+    uint64_t hedgeNanos[maxHosts] = {};
+    LatencyHistogram histograms[maxHosts];
+    std::mt19937 random{(unsigned)std::chrono::steady_clock::now().time_since_epoch().count()};
+
+    // Expected latency of a server, 0 for one not heard from lately so it gets tried
+    double expected(int server) const {
+        return monotonicMillis() - lastHeard[server] > clientReplicaStaleMs ? 0 : ewmaNanos[server];
+    }
+
+    // Replicas in the order to try them, servers known to be down are left out
+    std::vector<int> order(const int *replicas, int count, const FailureDetector &health) {
+        std::vector<int> order;
+        for (int i = 0; i < count; i++) {
+            if (!health.isDown(replicas[i])) {
+                order.push_back(replicas[i]);
+            }
+        }
+        if (order.size() > 1) {
+            // Two random candidates, the faster one first and the other next, it gets the hedge
+            // The fallbacks after them go fastest first, sorting the candidates too would send every hedge to the
+            // fastest replica
+            std::swap(order[0], order[random() % order.size()]);
+            std::swap(order[1], order[1 + random() % (order.size() - 1)]);
+            if (expected(order[1]) < expected(order[0])) {
+                std::swap(order[0], order[1]);
+            }
+            std::sort(order.begin() + 2, order.end(), [&](int a, int b) { return expected(a) < expected(b); });
+        }
+        return order;
+    }
+
+    void record(int server, uint64_t nanos) {
+        ewmaNanos[server] = lastHeard[server] ? ewmaNanos[server] + (nanos - ewmaNanos[server]) / 8 : nanos;
+        lastHeard[server] = monotonicMillis();
+        histograms[server].record(nanos);
+        // The percentile walks every bucket, refresh it now and then only
+        if (histograms[server].total % clientHedgeMinSamples == 0) {
+            hedgeNanos[server] = std::max<uint64_t>(histograms[server].percentile(clientHedgePercentile),
+                                                    clientHedgeMinMicros * 1000);
+        }
+    }
+
+    std::chrono::nanoseconds hedgeDeadline(int server) const {
+        return std::chrono::nanoseconds(hedgeNanos[server] ? hedgeNanos[server] : clientHedgeDefaultMicros * 1000);
+    }
+};
+
+class KvClient {
+public:
+    explicit KvClient(const ClusterConfig &config) : config(config), health(clientRetryDownMs), stopping(false) {
+        ring.build(config);
+        wakeFd = eventfd(0, EFD_NONBLOCK);
+        epollFd = epoll_create1(0);
+        if (wakeFd >= 0 && epollFd >= 0) {
+            epoll_event event;
+            event.events = EPOLLIN;
+            event.data.u64 = maxHosts;
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event);
+            loop = std::thread(&KvClient::run, this);
+        }
+    }
+
+    // Operations still in flight fail
+    ~KvClient() {
+        stopping.store(true);
+        wake();
+        if (loop.joinable()) {
+            loop.join();
+        }
+        if (wakeFd >= 0) {
+            close(wakeFd);
+        }
+        if (epollFd >= 0) {
+            close(epollFd);
+        }
+    }
+
+    KvClient(const KvClient &) = delete;
+    KvClient &operator=(const KvClient &) = delete;
+
+    const HashRing &hashRing() const { return ring; }
+
+    void get(uint64_t key, int consistency, KvCallback done) {
+        std::shared_ptr<KvCall> call = newCall(frameOp(OP_GET, consistency), done);
+        appendField(call->frame, key);
+        call->key = key;
+        call->hedge = true;
+        submit(call);
+    }
+
+    std::future<KvResult> get(uint64_t key, int consistency = CONSISTENCY_DEFAULT) {
+        std::shared_ptr<std::promise<KvResult> > promise(new std::promise<KvResult>());
+        get(key, consistency, [promise](KvResult &result) { promise->set_value(std::move(result)); });
+        return promise->get_future();
+    }
+
+    void put(uint64_t key, const std::string &value, int consistency, KvCallback done) {
+        std::shared_ptr<KvCall> call = newCall(frameOp(OP_SET, consistency), done);
+        appendField(call->frame, key);
+        appendValue(call->frame, value.data(), value.size());
+        call->key = key;
+        submit(call);
+    }
+
+    std::future<KvResult> put(uint64_t key, const std::string &value, int consistency = CONSISTENCY_DEFAULT) {
+        std::shared_ptr<std::promise<KvResult> > promise(new std::promise<KvResult>());
+        put(key, value, consistency, [promise](KvResult &result) { promise->set_value(std::move(result)); });
+        return promise->get_future();
+    }
+
+    // One result per key, in the order of keys
+    void multiGet(const std::vector<uint64_t> &keys, int consistency, KvBatchCallback done) {
+        batch(frameOp(OP_MGET, consistency), keys, NULL, done);
+    }
+
+    std::future<std::vector<KvResult> > multiGet(const std::vector<uint64_t> &keys,
+                                                 int consistency = CONSISTENCY_DEFAULT) {
+        std::shared_ptr<std::promise<std::vector<KvResult> > > promise(new std::promise<std::vector<KvResult> >());
+        multiGet(keys, consistency, [promise](std::vector<KvResult> &results) { promise->set_value(std::move(results)); });
+        return promise->get_future();
+    }
+
+    // values[i] is written to keys[i]
+    void multiPut(const std::vector<uint64_t> &keys, const std::vector<std::string> &values, int consistency,
+                  KvBatchCallback done) {
+        batch(frameOp(OP_MSET, consistency), keys, &values, done);
+    }
+
+    std::future<std::vector<KvResult> > multiPut(const std::vector<uint64_t> &keys,
+                                                 const std::vector<std::string> &values,
+                                                 int consistency = CONSISTENCY_DEFAULT) {
+        std::shared_ptr<std::promise<std::vector<KvResult> > > promise(new std::promise<std::vector<KvResult> >());
+        multiPut(keys, values, consistency,
+                 [promise](std::vector<KvResult> &results) { promise->set_value(std::move(results)); });
+        return promise->get_future();
+    }
+
+    // First page of the keys from start to end included, up to limit keys, 0 for as many as fit in a page
+    void scan(uint64_t start, uint64_t end, unsigned short limit, KvScanCallback done) {
+        std::shared_ptr<KvScanPage> page(new KvScanPage());
+        std::shared_ptr<KvCall> call(new KvCall());
+        call->op = OP_SCAN;
+        call->page = page;
+        beginFrame(call->frame, OP_SCAN, 0);
+        appendField(call->frame, start);
+        appendField(call->frame, end);
+        appendField(call->frame, limit);
+        call->done = [page, done](std::vector<KvResult> &results) {
+            page->ok = results[0].ok;
+            page->server = results[0].server;
+            done(*page);
+        };
+        submit(call);
+    }
+
+    std::future<KvScanPage> scan(uint64_t start, uint64_t end, unsigned short limit = 0) {
+        std::shared_ptr<std::promise<KvScanPage> > promise(new std::promise<KvScanPage>());
+        scan(start, end, limit, [promise](KvScanPage &page) { promise->set_value(std::move(page)); });
+        return promise->get_future();
+    }
+
+    // Metrics report of one server, as text in value
+    std::future<KvResult> stats(int server) {
+        std::shared_ptr<std::promise<KvResult> > promise(new std::promise<KvResult>());
+        std::shared_ptr<KvCall> call =
+            newCall(OP_STATS, [promise](KvResult &result) { promise->set_value(std::move(result)); });
+        call->server = server;
+        submit(call);
+        return promise->get_future();
+    }
+
+private:
+    // One request frame and the servers it may go to, in order
+    struct KvCall {
+        uint8_t op;
+        std::vector<char> frame;
+        uint64_t key = 0;
+        // Keys of an MGET or MSET frame, all in replica set
+        size_t keyCount = 1;
+        int set = -1;
+        // Server of a STATS request
+        int server = -1;
+        // Filled by the reply of a SCAN
+        std::shared_ptr<KvScanPage> page;
+        std::vector<int> candidates;
+        size_t next = 0;
+        // Request ids of the copies still unanswered
+        std::vector<uint32_t> inFlight;
+        bool hedge = false;
+        bool hedged = false;
+        bool finished = false;
+        std::function<void(std::vector<KvResult> &)> done;
+    };
+
+    // A copy of a call sent to one server
+    struct KvSend {
+        std::shared_ptr<KvCall> call;
+        int server;
+        std::chrono::steady_clock::time_point sentAt;
+    };
+
+    struct KvConnection {
+        int fd = -1;
+        // Tells the events of this connection from those of a closed one of the same server
+        uint32_t generation = 0;
+        bool connecting = false;
+        // EPOLLOUT is asked for, while connecting or when out could not all be sent
+        bool watchingOut = false;
+        std::chrono::steady_clock::time_point connectDeadline;
+        // Last time the server answered anything on this connection
+        std::chrono::steady_clock::time_point lastReply;
+        std::vector<char> out;
+        size_t outSent = 0;
+        std::vector<char> in;
+    };
+
+    enum { TIMER_REQUEST, TIMER_HEDGE, TIMER_CONNECT };
+
+    struct KvTimer {
+        std::chrono::steady_clock::time_point at;
+        // Request id, or the server of a TIMER_CONNECT
+        uint32_t id;
+        int kind;
+        bool operator>(const KvTimer &other) const { return at > other.at; }
+    };
+
+    ClusterConfig config;
+    HashRing ring;
+    FailureDetector health;
+    int wakeFd = -1;
+    int epollFd = -1;
+    std::thread loop;
+    std::atomic<bool> stopping;
+    std::mutex submitLock;
+    std::vector<std::shared_ptr<KvCall> > submitted;
+
+    // Only touched by the loop thread
+    std::unique_ptr<ReplicaTracker> tracker{new ReplicaTracker()};
+    KvConnection connections[maxHosts];
+    std::vector<int> dirty;
+    std::unordered_map<uint32_t, KvSend> sends;
+    std::priority_queue<KvTimer, std::vector<KvTimer>, std::greater<KvTimer> > timers;
+    uint32_t lastRequestId = 0;
+    uint32_t lastGeneration = 0;
+
+    std::shared_ptr<KvCall> newCall(uint8_t op, KvCallback done) {
+        std::shared_ptr<KvCall> call(new KvCall());
+        call->op = op;
+        // The request id is set each time the frame is sent, the frame is closed by submit
+        beginFrame(call->frame, op, 0);
+        call->done = [done](std::vector<KvResult> &results) { done(results[0]); };
+        return call;
+    }
+
+    // Split a batch by replica set, gather the results of its frames and answer once all are in
+    void batch(uint8_t op, const std::vector<uint64_t> &keys, const std::vector<std::string> *values,
+               KvBatchCallback done) {
+        struct Gather {
+            std::vector<KvResult> results;
+            size_t remaining = 0;
+            KvBatchCallback done;
+        };
+        std::shared_ptr<Gather> gather(new Gather());
+        gather->results.resize(keys.size());
+        gather->done = done;
+        std::map<int, std::vector<size_t> > sets;
+        for (size_t i = 0; i < keys.size(); i++) {
+            sets[ring.replicaSetOf(keys[i])].push_back(i);
+        }
+        std::vector<std::shared_ptr<KvCall> > calls;
+        for (auto &set : sets) {
+            for (size_t first = 0; first < set.second.size(); first += clientBatchKeys) {
+                size_t last = std::min(set.second.size(), first + clientBatchKeys);
+                std::vector<size_t> indexes(set.second.begin() + first, set.second.begin() + last);
+                std::shared_ptr<KvCall> call(new KvCall());
+                call->op = op;
+                call->set = set.first;
+                call->keyCount = indexes.size();
+                beginFrame(call->frame, op, 0);
+                appendField<unsigned short int>(call->frame, indexes.size());
+                for (size_t i : indexes) {
+                    appendField(call->frame, keys[i]);
+                    if (values) {
+                        appendValue(call->frame, (*values)[i].data(), (*values)[i].size());
+                    }
+                }
+                call->done = [gather, indexes](std::vector<KvResult> &results) {
+                    for (size_t i = 0; i < indexes.size(); i++) {
+                        gather->results[indexes[i]] = std::move(results[i]);
+                    }
+                    if (--gather->remaining == 0) {
+                        gather->done(gather->results);
+                    }
+                };
+                calls.push_back(call);
+            }
+        }
+        gather->remaining = calls.size();
+        if (calls.empty()) {
+            done(gather->results);
+            return;
+        }
+        submit(calls);
+    }
+
+    void submit(const std::shared_ptr<KvCall> &call) { submit(std::vector<std::shared_ptr<KvCall> >(1, call)); }
+
+    void submit(const std::vector<std::shared_ptr<KvCall> > &calls) {
+        for (auto &call : calls) {
+            endFrame(call->frame, 0);
+        }
+        if (!loop.joinable()) {
+            // No event loop, the client could not get an epoll or eventfd descriptor
+            for (auto &call : calls) {
+                fail(call);
+            }
+            return;
+        }
+        bool idle;
+        {
+            std::lock_guard<std::mutex> guard(submitLock);
+            // Calls already waiting mean the loop was woken and has not taken them yet
+            idle = submitted.empty();
+            submitted.insert(submitted.end(), calls.begin(), calls.end());
+        }
+        if (idle) {
+            wake();
+        }
+    }
+
+    void wake() {
+        uint64_t one = 1;
+        if (wakeFd >= 0 && write(wakeFd, &one, sizeof(one)) < 0) {
+            // Already signaled
+        }
+    }
+
+    // Servers to try for a call, in order, leaving out the ones known to be down unless all of them are
+    void route(KvCall &call) {
+        uint8_t op = call.op & OP_MASK;
+        if (op == OP_STATS) {
+            call.candidates.push_back(call.server);
+            return;
+        }
+        if (op == OP_SCAN) {
+            // Any server coordinates a scan
+            std::vector<int> servers;
+            for (int server = 0; server < ring.hostCount; server++) {
+                servers.push_back(server);
+            }
+            call.candidates = tracker->order(servers.data(), servers.size(), health);
+            if (call.candidates.empty()) {
+                call.candidates = servers;
+            }
+            return;
+        }
+        if (op == OP_GET || op == OP_MGET) {
+            const int *replicas = op == OP_GET ? ring.replicas(call.key) : ring.setHolders(call.set);
+            call.candidates = tracker->order(replicas, ring.replicaCount, health);
+            if (call.candidates.empty()) {
+                call.candidates.assign(replicas, replicas + ring.replicaCount);
+            }
+            return;
+        }
+        // Writes go to the owner first, a single write to its next replica only
+        const int *replicas = op == OP_SET ? ring.replicas(call.key) : ring.setHolders(call.set);
+        int count = op == OP_SET ? std::min(2, ring.replicaCount) : ring.replicaCount;
+        for (int i = 0; i < count; i++) {
+            if (!health.isDown(replicas[i])) {
+                call.candidates.push_back(replicas[i]);
+            }
+        }
+        if (call.candidates.empty()) {
+            call.candidates.assign(replicas, replicas + count);
+        }
+    }
+
+    uint64_t eventData(int server) const { return (uint64_t)connections[server].generation << 32 | server; }
+
+    // Open a connection to a server if it has none
+    // Return false if the connect failed right away
+    bool connectServer(int server) {
+        KvConnection &connection = connections[server];
+        if (connection.fd >= 0) {
+            return true;
+        }
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd < 0) {
+            return false;
+        }
+        sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = inet_addr(config.hosts[server].c_str());
+        address.sin_port = htons(config.ports[server]);
+        if (connect(fd, (sockaddr *)&address, sizeof(address)) < 0 && errno != EINPROGRESS) {
+            close(fd);
+            health.failed(server);
+            return false;
+        }
+        connection.fd = fd;
+        connection.generation = ++lastGeneration;
+        connection.connecting = true;
+        connection.watchingOut = true;
+        connection.connectDeadline =
+            std::chrono::steady_clock::now() + std::chrono::milliseconds(clientConnectTimeoutMs);
+        epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT;
+        event.data.u64 = eventData(server);
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+        timers.push(KvTimer{connection.connectDeadline, (uint32_t)server, TIMER_CONNECT});
+        return true;
+    }
+
+    // Send a call to its next candidate
+    // Return false if none is left
+    bool sendNext(const std::shared_ptr<KvCall> &call) {
+        while (call->next < call->candidates.size()) {
+            int server = call->candidates[call->next++];
+            if (!connectServer(server)) {
+                continue;
+            }
+            uint32_t requestId = ++lastRequestId;
+            memcpy(&call->frame[offsetof(FrameHeader, requestId)], &requestId, sizeof(requestId));
+            KvConnection &connection = connections[server];
+            if (connection.out.empty()) {
+                dirty.push_back(server);
+            }
+            connection.out.insert(connection.out.end(), call->frame.begin(), call->frame.end());
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            KvSend &send = sends[requestId];
+            send.call = call;
+            send.server = server;
+            send.sentAt = now;
+            call->inFlight.push_back(requestId);
+            timers.push(KvTimer{now + std::chrono::milliseconds(clientRequestTimeoutMs), requestId, TIMER_REQUEST});
+            if (call->hedge && !call->hedged) {
+                timers.push(KvTimer{now + tracker->hedgeDeadline(server), requestId, TIMER_HEDGE});
+            }
+            return true;
+        }
+        return false;
+    }
+
+    void finish(const std::shared_ptr<KvCall> &call, std::vector<KvResult> &results) {
+        call->finished = true;
+        // Late replies of the other copies are skipped
+        for (uint32_t requestId : call->inFlight) {
+            sends.erase(requestId);
+        }
+        call->inFlight.clear();
+        call->done(results);
+    }
+
+    void fail(const std::shared_ptr<KvCall> &call) {
+        std::vector<KvResult> results(call->keyCount);
+        for (KvResult &result : results) {
+            result.hedged = call->hedged;
+        }
+        finish(call, results);
+    }
+
+    // A server failed to connect, to take a request or to answer in time: drop its connection and move its
+    // requests on to their next candidates
+    void failServer(int server) {
+        health.failed(server);
+        KvConnection &connection = connections[server];
+        if (connection.fd >= 0) {
+            close(connection.fd);
+        }
+        connection = KvConnection();
+        std::vector<uint32_t> failed;
+        for (auto &send : sends) {
+            if (send.second.server == server) {
+                failed.push_back(send.first);
+            }
+        }
+        for (uint32_t requestId : failed) {
+            failSend(requestId);
+        }
+    }
+
+    // A copy of a call will not be answered, the call moves on to its next candidate unless another copy is pending
+    void failSend(uint32_t requestId) {
+        auto found = sends.find(requestId);
+        if (found == sends.end()) {
+            return;  // Its call was finished by an earlier failure
+        }
+        std::shared_ptr<KvCall> call = found->second.call;
+        sends.erase(found);
+        call->inFlight.erase(std::find(call->inFlight.begin(), call->inFlight.end(), requestId));
+        if (call->inFlight.empty() && !sendNext(call)) {
+            fail(call);
+        }
+    }
+
+    // Decode the reply of a call
+    void answer(const std::shared_ptr<KvCall> &call, int server, const char *data, const char *end) {
+        std::vector<KvResult> results(call->keyCount);
+        for (KvResult &result : results) {
+            result.server = server;
+            result.hedged = call->hedged;
+        }
+        uint8_t op = call->op & OP_MASK;
+        uint8_t status = 0;
+        const char *value = "";
+        uint32_t length = 0;
+        if (op == OP_STATS) {
+            results[0].ok = true;
+            results[0].value.assign(data, end);
+        } else if (op == OP_SCAN) {
+            uint8_t more;
+            unsigned short int count;
+            KvScanPage &page = *call->page;
+            if (readField(data, end, &status) && readField(data, end, &more) && readField(data, end, &page.next) &&
+                readField(data, end, &count)) {
+                StoreEntry entry;
+                for (int i = 0; i < count && readEntry(data, end, &entry, &value); i++) {
+                    page.entries.push_back(std::make_pair((uint64_t)entry.key, std::string(value, entry.length)));
+                }
+                results[0].ok = status == 1 && page.entries.size() == count;
+                page.more = more;
+            }
+        } else if (op == OP_GET || op == OP_SET) {
+            if (readField(data, end, &status)) {
+                results[0].ok = op == OP_GET ? status != READ_UNAVAILABLE : status == 1;
+                results[0].found = op == OP_GET && status == READ_FOUND;
+            }
+            if (results[0].found && readValue(data, end, &value, &length)) {
+                results[0].value.assign(value, length);
+            }
+        } else {
+            unsigned short int count = 0;
+            readField(data, end, &count);
+            for (size_t i = 0; i < count && i < results.size() && readField(data, end, &status); i++) {
+                if (op == OP_MSET) {
+                    results[i].ok = status == 1;
+                    continue;
+                }
+                if (!readValue(data, end, &value, &length)) {
+                    break;
+                }
+                results[i].ok = status != READ_UNAVAILABLE;
+                results[i].found = status == READ_FOUND;
+                results[i].value.assign(value, length);
+            }
+        }
+        finish(call, results);
+    }
+
+    void onReply(int server, const FrameHeader &header, const char *payload) {
+        auto found = sends.find(header.requestId);
+        if (found == sends.end()) {
+            return;  // A late reply to a copy of a call answered by another server
+        }
+        KvSend send = found->second;
+        sends.erase(found);
+        health.heard(server);
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        connections[server].lastReply = now;
+        if ((send.call->op & OP_MASK) == OP_GET) {
+            tracker->record(server, std::chrono::duration_cast<std::chrono::nanoseconds>(now - send.sentAt).count());
+            // The replicas that lost the race were slower than this, let their averages know
+            for (uint32_t requestId : send.call->inFlight) {
+                auto other = sends.find(requestId);
+                if (requestId != header.requestId && other != sends.end()) {
+                    tracker->record(other->second.server, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                                              now - other->second.sentAt).count());
+                }
+            }
+        }
+        send.call->inFlight.erase(std::find(send.call->inFlight.begin(), send.call->inFlight.end(), header.requestId));
+        answer(send.call, server, payload, payload + header.length);
+    }
+
+    void flush(int server) {
+        KvConnection &connection = connections[server];
+        if (connection.fd < 0 || connection.connecting) {
+            return;
+        }
+        while (connection.outSent < connection.out.size()) {
+            ssize_t sent = ::send(connection.fd, connection.out.data() + connection.outSent,
+                                  connection.out.size() - connection.outSent, MSG_NOSIGNAL);
+            if (sent < 0 && errno == EINTR) {
+                continue;
+            }
+            if (sent < 0 && errno != EAGAIN) {
+                failServer(server);
+                return;
+            }
+            if (sent < 0) {
+                break;
+            }
+            connection.outSent += sent;
+        }
+        if (connection.outSent == connection.out.size()) {
+            connection.out.clear();
+            connection.outSent = 0;
+        }
+        bool watchOut = !connection.out.empty();
+        if (watchOut != connection.watchingOut) {
+            epoll_event event;
+            event.events = EPOLLIN | (watchOut ? EPOLLOUT : 0);
+            event.data.u64 = eventData(server);
+            epoll_ctl(epollFd, EPOLL_CTL_MOD, connection.fd, &event);
+            connection.watchingOut = watchOut;
+        }
+    }
+
+    void onWritable(int server) {
+        KvConnection &connection = connections[server];
+        if (connection.connecting) {
+            int error = 0;
+            socklen_t length = sizeof(error);
+            if (getsockopt(connection.fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error) {
+                failServer(server);
+                return;
+            }
+            connection.connecting = false;
+            connection.lastReply = std::chrono::steady_clock::now();
+            health.heard(server);
+        }
+        flush(server);
+    }
+
+    void onReadable(int server) {
+        KvConnection &connection = connections[server];
+        char buffer[64 * 1024];
+        while (true) {
+            ssize_t received = recv(connection.fd, buffer, sizeof(buffer), 0);
+            if (received < 0 && errno == EINTR) {
+                continue;
+            }
+            if (received < 0 && errno == EAGAIN) {
+                break;
+            }
+            if (received <= 0) {
+                failServer(server);
+                return;
+            }
+            connection.in.insert(connection.in.end(), buffer, buffer + received);
+        }
+        size_t offset = 0;
+        while (connection.in.size() - offset >= sizeof(FrameHeader)) {
+            FrameHeader header;
+            memcpy(&header, connection.in.data() + offset, sizeof(header));
+            if (header.magic != FRAME_MAGIC || header.length > maxFramePayload) {
+                failServer(server);
+                return;
+            }
+            if (connection.in.size() - offset - sizeof(header) < header.length) {
+                break;
+            }
+            onReply(server, header, connection.in.data() + offset + sizeof(header));
+            offset += sizeof(header) + header.length;
+        }
+        connection.in.erase(connection.in.begin(), connection.in.begin() + offset);
+    }
+
+    void onTimer(const KvTimer &timer) {
+        if (timer.kind == TIMER_CONNECT) {
+            KvConnection &connection = connections[timer.id];
+            if (connection.connecting && connection.connectDeadline <= timer.at) {
+                failServer(timer.id);
+            }
+            return;
+        }
+        auto found = sends.find(timer.id);
+        if (found == sends.end()) {
+            return;
+        }
+        if (timer.kind == TIMER_REQUEST) {
+            // A server still answering other requests is slow, not down, only this request moves on
+            int server = found->second.server;
+            if (timer.at - connections[server].lastReply < std::chrono::milliseconds(clientRequestTimeoutMs)) {
+                failSend(timer.id);
+            } else {
+                failServer(server);
+            }
+            return;
+        }
+        // Hedge: the first copy of a read is late, a second replica gets it too if there is one
+        std::shared_ptr<KvCall> call = found->second.call;
+        if (!call->hedged && call->next < call->candidates.size()) {
+            call->hedged = true;
+            sendNext(call);
+        }
+    }
+
+    void run() {
+        std::vector<epoll_event> events(maxHosts + 1);
+        while (!stopping.load()) {
+            int timeout = -1;
+            if (!timers.empty()) {
+                std::chrono::steady_clock::duration wait = timers.top().at - std::chrono::steady_clock::now();
+                timeout = std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::milliseconds>(wait).count() + 1);
+            }
+            int ready = epoll_wait(epollFd, events.data(), events.size(), timeout);
+            for (int i = 0; i < ready; i++) {
+                int server = (uint32_t)events[i].data.u64;
+                if (server == maxHosts) {
+                    uint64_t count;
+                    if (read(wakeFd, &count, sizeof(count)) < 0) {
+                        // Nothing to drain
+                    }
+                    continue;
+                }
+                if (events[i].data.u64 != eventData(server) || connections[server].fd < 0) {
+                    continue;  // A connection failed by an earlier event of this round
+                }
+                if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                    onReadable(server);
+                }
+                if (events[i].data.u64 == eventData(server) && (events[i].events & EPOLLOUT)) {
+                    onWritable(server);
+                }
+            }
+            std::vector<std::shared_ptr<KvCall> > calls;
+            {
+                std::lock_guard<std::mutex> guard(submitLock);
+                calls.swap(submitted);
+            }
+            for (auto &call : calls) {
+                route(*call);
+                if (!sendNext(call)) {
+                    fail(call);
+                }
+            }
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            while (!timers.empty() && timers.top().at <= now) {
+                KvTimer timer = timers.top();
+                timers.pop();
+                onTimer(timer);
+            }
+            // Everything queued this round goes out in one send per server
+            std::vector<int> flushing;
+            flushing.swap(dirty);
+            for (int server : flushing) {
+                flush(server);
+            }
+        }
+        std::vector<std::shared_ptr<KvCall> > unanswered;
+        for (auto &send : sends) {
+            if (std::find(unanswered.begin(), unanswered.end(), send.second.call) == unanswered.end()) {
+                unanswered.push_back(send.second.call);
+            }
+        }
+        {
+            std::lock_guard<std::mutex> guard(submitLock);
+            unanswered.insert(unanswered.end(), submitted.begin(), submitted.end());
+            submitted.clear();
+        }
+        for (auto &call : unanswered) {
+            fail(call);
+        }
+        for (int server = 0; server < maxHosts; server++) {
+            if (connections[server].fd >= 0) {
+                close(connections[server].fd);
+            }
+        }
+    }
+};
@@ -0,0 +1,198 @@
+// Cluster layout shared by the server and the client: the config file and the consistent hash ring placing keys
+//
+// config.txt lists one server per line as serverN=host[:port], in server number order, plus optional settings:
+//   replicas=3   servers holding each key
+//   vnodes=64    points every server owns on the ring
+// The file is read from the path in the KV_CONFIG environment variable, or config.txt in the working directory.
+//
+// Each server owns vnodes points on a 64 bit ring, placed by hashing its host:port. A key belongs to the owner of
+// the first point at or after the hash of the key, and is copied to the next distinct servers met clockwise.
+// Adding or removing a server only moves the keys of the ring segments its points cover, about 1/N of them.
+//
+// Points copied to the same servers in the same order form a replica set: every key of a replica set is held by
+// exactly the same servers, so two of them can compare what they hold of it key for key.
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Largest cluster supported, arrays kept per server are sized by it
+const int maxHosts = 16;
+const int defaultPort = 4430;
+
+struct ClusterConfig {
+    std::vector<std::string> hosts;
+    std::vector<int> ports;
+    int replicas = 3;
+    int vnodes = 64;
+};
+
+inline std::string clusterConfigPath() {
+    const char *path = getenv("KV_CONFIG");
+    return path ? path : "config.txt";
+}
+
+// Read the cluster config, return false if the file is missing or lists no server
+inline bool loadClusterConfig(const std::string &filename, ClusterConfig &config) {
+    std::ifstream file(filename);
+    if (!file) {
+        return false;
+    }
+    std::string line;
+    while (getline(file, line)) {
+        size_t eq = line.find('=');
+        if (line.empty() || line[0] == '#' || eq == std::string::npos) {
+            continue;
+        }
+        std::string name = line.substr(0, eq);
+        std::string value = line.substr(eq + 1);
+        while (!value.empty() && (value.back() == '\r' || value.back() == ' ')) {
+            value.pop_back();
+        }
+        if (name == "replicas") {
+            config.replicas = atoi(value.c_str());
+        } else if (name == "vnodes") {
+            config.vnodes = atoi(value.c_str());
+        } else if (name.compare(0, 6, "server") == 0 && (int)config.hosts.size() < maxHosts) {
+            size_t colon = value.find(':');
+            config.hosts.push_back(value.substr(0, colon));
+            config.ports.push_back(colon == std::string::npos ? defaultPort : atoi(value.c_str() + colon + 1));
+        }
+    }
+    config.replicas = std::max(1, std::min(config.replicas, (int)config.hosts.size()));
+    config.vnodes = std::max(1, config.vnodes);
+    return !config.hosts.empty();
+}
+
+// splitmix64 finalizer, spreads neighbouring keys over the whole ring
+inline uint64_t ringHash(uint64_t value) {
+    value += 0x9E3779B97F4A7C15ULL;
+    value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+    return value ^ (value >> 31);
+}
+
+inline uint64_t ringHash(const std::string &text) {
+    // FNV-1a, then mixed
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (size_t i = 0; i < text.size(); i++) {
+        hash = (hash ^ (unsigned char)text[i]) * 0x100000001B3ULL;
+    }
+    return ringHash(hash);
+}
+
+struct HashRing {
+    // Points sorted by token, with the servers holding the keys that land on each point
+    std::vector<uint64_t> tokens;
+    std::vector<int> pointReplicas;  // replicaCount entries per point, the first one is the owner
+    std::vector<int> pointSets;      // replica set of every point
+    std::vector<int> setReplicas;    // replicaCount entries per replica set, the owner first
+    int replicaCount = 0;
+    int hostCount = 0;
+
+    void build(const ClusterConfig &config) {
+        hostCount = config.hosts.size();
+        replicaCount = std::min(config.replicas, hostCount);
+        std::vector<std::pair<uint64_t, int> > points;
+        for (int host = 0; host < hostCount; host++) {
+            for (int v = 0; v < config.vnodes; v++) {
+                std::string name = config.hosts[host] + ":" + std::to_string(config.ports[host]) + "#" + std::to_string(v);
+                points.push_back(std::make_pair(ringHash(name), host));
+            }
+        }
+        std::sort(points.begin(), points.end());
+        tokens.clear();
+        pointReplicas.clear();
+        for (size_t i = 0; i < points.size(); i++) {
+            tokens.push_back(points[i].first);
+            // Walk clockwise until replicaCount distinct servers are found
+            int found = 0;
+            for (size_t j = 0; found < replicaCount; j++) {
+                int host = points[(i + j) % points.size()].second;
+                if (std::find(pointReplicas.end() - found, pointReplicas.end(), host) == pointReplicas.end()) {
+                    pointReplicas.push_back(host);
+                    found++;
+                }
+            }
+        }
+        std::map<std::vector<int>, int> sets;
+        pointSets.clear();
+        setReplicas.clear();
+        for (size_t i = 0; i < tokens.size(); i++) {
+            std::vector<int> holders(pointReplicas.begin() + i * replicaCount,
+                                     pointReplicas.begin() + (i + 1) * replicaCount);
+            auto found = sets.find(holders);
+            if (found == sets.end()) {
+                found = sets.insert(std::make_pair(holders, (int)sets.size())).first;
+                setReplicas.insert(setReplicas.end(), holders.begin(), holders.end());
+            }
+            pointSets.push_back(found->second);
+        }
+    }
+
+    // Point whose replicas hold a key
+    size_t pointOf(uint64_t key) const {
+        size_t point = std::lower_bound(tokens.begin(), tokens.end(), ringHash(key)) - tokens.begin();
+        return point == tokens.size() ? 0 : point;
+    }
+
+    // Servers holding a key, replicaCount of them, the owner first
+    const int *replicas(uint64_t key) const { return &pointReplicas[pointOf(key) * replicaCount]; }
+
+    int replicaSetOf(uint64_t key) const { return pointSets[pointOf(key)]; }
+
+    int setCount() const { return setReplicas.size() / std::max(1, replicaCount); }
+
+    // Servers of a replica set, replicaCount of them, the owner first
+    const int *setHolders(int set) const { return &setReplicas[set * replicaCount]; }
+
+    bool isSetHolder(int set, int host) const {
+        const int *holders = setHolders(set);
+        return std::find(holders, holders + replicaCount, host) != holders + replicaCount;
+    }
+
+    int owner(uint64_t key) const { return replicas(key)[0]; }
+
+    bool isReplica(uint64_t key, int host) const {
+        const int *holders = replicas(key);
+        return std::find(holders, holders + replicaCount, host) != holders + replicaCount;
+    }
+
+    // Hash ranges, named by their owner, with at least one point whose keys host keeps a copy of
+    std::vector<bool> rangesHeldBy(int host) const {
+        std::vector<bool> held(hostCount, false);
+        for (size_t point = 0; point < tokens.size(); point++) {
+            const int *holders = &pointReplicas[point * replicaCount];
+            if (std::find(holders, holders + replicaCount, host) != holders + replicaCount) {
+                held[holders[0]] = true;
+            }
+        }
+        return held;
+    }
+
+    // Servers sharing at least one replica set with host, the ones it replicates with and recovers from
+    std::vector<int> neighbours(int host) const {
+        std::vector<bool> shared(hostCount, false);
+        for (size_t point = 0; point < tokens.size(); point++) {
+            const int *holders = &pointReplicas[point * replicaCount];
+            if (std::find(holders, holders + replicaCount, host) != holders + replicaCount) {
+                for (int i = 0; i < replicaCount; i++) {
+                    shared[holders[i]] = true;
+                }
+            }
+        }
+        std::vector<int> result;
+        for (int i = 0; i < hostCount; i++) {
+            if (shared[i] && i != host) {
+                result.push_back(i);
+            }
+        }
+        return result;
+    }
+};
@@ -0,0 +1,112 @@
+// Failure detection shared by the server and the client: connects and requests bounded by deadlines, and a detector
+// remembering which servers are down so requests skip them right away instead of each waiting for a timeout
+//
+// A server is marked down when a connect or a request to it fails or runs past its deadline, and up again as soon as
+// it answers anything. Servers send heartbeats to their neighbours, so a peer coming back is seen within one
+// heartbeat interval. The client sends none, it lets one request try a down server again after retryAfter.
+#pragma once
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "cluster.h"
+
+inline int64_t monotonicMillis() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+// Bound every later send and recv on a socket, a call blocked longer fails with EAGAIN
+inline void setSocketDeadline(int socket, int milliseconds) {
+    timeval timeout;
+    timeout.tv_sec = milliseconds / 1000;
+    timeout.tv_usec = (milliseconds % 1000) * 1000;
+    setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+// Connect to host:port without waiting longer than milliseconds for the handshake
+// Return a blocking socket, or -1 with errno set, ETIMEDOUT if the deadline passed
+inline int connectWithDeadline(const std::string &host, int port, int milliseconds) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = inet_addr(host.c_str());
+    address.sin_port = htons(port);
+    int error = 0;
+    if (connect(fd, (sockaddr *)&address, sizeof(address)) < 0) {
+        error = errno;
+    }
+    if (error == EINPROGRESS) {
+        int64_t deadline = monotonicMillis() + milliseconds;
+        pollfd writable;
+        writable.fd = fd;
+        writable.events = POLLOUT;
+        int ready;
+        do {
+            ready = poll(&writable, 1, std::max<int64_t>(0, deadline - monotonicMillis()));
+        } while (ready < 0 && errno == EINTR);
+        socklen_t length = sizeof(error);
+        if (ready == 0) {
+            error = ETIMEDOUT;
+        } else if (ready < 0) {
+            error = errno;
+        } else if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0) {
+            error = errno;
+        }
+    }
+    if (error) {
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    return fd;
+}
+
+struct FailureDetector {
+    std::atomic<bool> down[maxHosts];
+    std::atomic<int64_t> failedAt[maxHosts];
+    // Milliseconds a down server is skipped before a request may try it again, 0 to wait until it is heard from
+    int retryAfter;
+
+    explicit FailureDetector(int retryAfter = 0) : retryAfter(retryAfter) {
+        for (int i = 0; i < maxHosts; i++) {
+            down[i].store(false);
+            failedAt[i].store(0);
+        }
+    }
+
+    bool isDown(int host) const {
+        return down[host].load() && (retryAfter == 0 || monotonicMillis() - failedAt[host].load() < retryAfter);
+    }
+
+    // A connect or request to host failed or timed out
+    // Return true if host was up until now
+    bool failed(int host) {
+        failedAt[host].store(monotonicMillis());
+        return !down[host].exchange(true);
+    }
+
+    // host answered
+    // Return true if host was down until now
+    bool heard(int host) { return down[host].exchange(false); }
+};
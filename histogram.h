@@ -0,0 +1,119 @@
+// Latency histogram with HDR style log-linear buckets, shared by the client benchmark and the server metrics
+//
+// Values below 2^histogramSubBits get a bucket each, larger values are grouped by their highest bit and split
+// into 2^histogramSubBits linear sub-buckets, so every recorded value is kept within about 3% of its real value.
+// Counts are relaxed atomics: one thread records, any thread can read a consistent enough view or merge it.
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+const int histogramSubBits = 5;
+const int histogramBuckets = (64 - histogramSubBits + 1) << histogramSubBits;
+
+// Bucket of a value
+inline int histogramBucket(uint64_t value) {
+    if (value < (uint64_t(1) << histogramSubBits)) {
+        return value;
+    }
+    int highestBit = 63 - __builtin_clzll(value);
+    int shift = highestBit - histogramSubBits;
+    return ((shift + 1) << histogramSubBits) + ((value >> shift) & ((1 << histogramSubBits) - 1));
+}
+
+// Highest value that falls in a bucket
+inline uint64_t histogramBucketValue(int bucket) {
+    int group = bucket >> histogramSubBits;
+    uint64_t subBucket = bucket & ((1 << histogramSubBits) - 1);
+    if (group == 0) {
+        return subBucket;
+    }
+    int shift = group - 1;
+    return ((((uint64_t(1) << histogramSubBits) + subBucket + 1) << shift) - 1);
+}
+
+struct LatencyHistogram {
+    std::atomic<uint64_t> counts[histogramBuckets];
+    std::atomic<uint64_t> total;
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> maximum;
+
+    LatencyHistogram() { reset(); }
+
+    void reset() {
+        for (int i = 0; i < histogramBuckets; i++) {
+            counts[i].store(0, std::memory_order_relaxed);
+        }
+        total.store(0, std::memory_order_relaxed);
+        sum.store(0, std::memory_order_relaxed);
+        maximum.store(0, std::memory_order_relaxed);
+    }
+
+    // Only called by the thread owning the histogram, so plain load and store are enough
+    void record(uint64_t value) {
+        int bucket = histogramBucket(value);
+        counts[bucket].store(counts[bucket].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        total.store(total.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        sum.store(sum.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+        if (value > maximum.load(std::memory_order_relaxed)) {
+            maximum.store(value, std::memory_order_relaxed);
+        }
+    }
+
+    // Add the counts of another histogram, the other one may still be recording
+    void merge(const LatencyHistogram &other) {
+        for (int i = 0; i < histogramBuckets; i++) {
+            uint64_t count = other.counts[i].load(std::memory_order_relaxed);
+            if (count) {
+                counts[i].fetch_add(count, std::memory_order_relaxed);
+            }
+        }
+        total.fetch_add(other.total.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        sum.fetch_add(other.sum.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        uint64_t otherMaximum = other.maximum.load(std::memory_order_relaxed);
+        uint64_t current = maximum.load(std::memory_order_relaxed);
+        while (current < otherMaximum && !maximum.compare_exchange_weak(current, otherMaximum)) {
+        }
+    }
+
+    // Value at a percentile from 0 to 100, reported as the highest value of its bucket
+    uint64_t percentile(double percent) const {
+        uint64_t count = total.load(std::memory_order_relaxed);
+        if (count == 0) {
+            return 0;
+        }
+        uint64_t rank = (uint64_t)(percent / 100.0 * count + 0.5);
+        if (rank < 1) {
+            rank = 1;
+        }
+        uint64_t seen = 0;
+        for (int i = 0; i < histogramBuckets; i++) {
+            seen += counts[i].load(std::memory_order_relaxed);
+            if (seen >= rank) {
+                uint64_t value = histogramBucketValue(i);
+                uint64_t highest = maximum.load(std::memory_order_relaxed);
+                return value < highest ? value : highest;
+            }
+        }
+        return maximum.load(std::memory_order_relaxed);
+    }
+
+    double mean() const {
+        uint64_t count = total.load(std::memory_order_relaxed);
+        return count ? (double)sum.load(std::memory_order_relaxed) / count : 0;
+    }
+
+    // Summary as a JSON object, values recorded in nanoseconds are reported in microseconds
+    std::string json() const {
+        char buffer[256];
+        snprintf(buffer, sizeof(buffer),
+                 "{\"count\": %llu, \"mean_us\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, "
+                 "\"max_us\": %.1f}",
+                 (unsigned long long)total.load(std::memory_order_relaxed), mean() / 1000, percentile(50) / 1000.0,
+                 percentile(99) / 1000.0, percentile(99.9) / 1000.0,
+                 maximum.load(std::memory_order_relaxed) / 1000.0);
+        return buffer;
+    }
+};
@@ -0,0 +1,414 @@
+// Asynchronous logger: a call site copies a binary record, its format string, a formatter and the raw arguments,
+// into a ring buffer of its own thread, and a background thread formats and prints the records of every thread in
+// time order. Logging costs a clock read and a copy of the arguments, never a lock, a format or a write to stdout.
+//
+// LOG_DEBUG call sites compile out, arguments and all, unless LOG_COMPILED_LEVEL is lowered to LOG_LEVEL_DEBUG.
+// Other levels are filtered at run time by logLevel(). A call site writes at most logRatePerSecond records per second
+// per thread, the ones it suppresses are counted on the next record it writes. A full ring drops records and counts
+// them, a thread never waits for the logger.
+//
+// Formats are checked like printf at compile time. String arguments are copied into the record, so they may be
+// temporaries, every other argument is copied by value.
+#pragma once
+
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+
+#ifndef LOG_COMPILED_LEVEL
+#define LOG_COMPILED_LEVEL LOG_LEVEL_INFO
+#endif
+
+// Bytes of the ring of each thread, a power of two
+const size_t logRingSize = 256 * 1024;
+const uint32_t logRatePerSecond = 1000;
+// Microseconds the logger thread sleeps when every ring is empty
+const int logIdleMicros = 1000;
+
+inline std::atomic<int> &logLevel() {
+    static std::atomic<int> level(LOG_LEVEL_INFO);
+    return level;
+}
+
+typedef void (*LogFormatter)(std::string &out, const char *format, const char *args);
+
+// Header of a record in a ring, followed by its arguments
+struct LogRecord {
+    // Bytes of the record with its arguments, a multiple of 8, 0 marks the unused end of the ring
+    uint32_t size;
+    uint32_t suppressed;
+    int64_t nanos;
+    LogFormatter formatter;
+    const char *format;
+    int level;
+};
+
+// Ring of one thread, written by it and read by the logger thread
+struct LogRing {
+    char *data;
+    std::atomic<size_t> head;
+    char padding[64];
+    std::atomic<size_t> tail;
+    std::atomic<uint64_t> dropped;
+    size_t reservedTail;
+
+    LogRing() : data(new char[logRingSize]), head(0), tail(0), dropped(0), reservedTail(0) {}
+
+    // Room for size contiguous bytes, NULL if the ring is full
+    char *reserve(size_t size) {
+        size_t position = tail.load(std::memory_order_relaxed);
+        size_t offset = position & (logRingSize - 1);
+        // A record never wraps, the end of the ring is skipped when it does not fit there
+        size_t skip = offset + size > logRingSize ? logRingSize - offset : 0;
+        if (position + skip + size - head.load(std::memory_order_acquire) > logRingSize) {
+            return NULL;
+        }
+        if (skip) {
+            memset(data + offset, 0, sizeof(uint32_t));
+            position += skip;
+        }
+        reservedTail = position + size;
+        return data + (position & (logRingSize - 1));
+    }
+
+    void commit() { tail.store(reservedTail, std::memory_order_release); }
+};
+
+// Every ring ever handed out, rings of finished threads are kept and reused
+struct LogRegistry {
+    std::mutex lock;
+    std::vector<LogRing *> rings;
+    std::vector<LogRing *> free;
+    // Held while draining, so the logger thread and a flush never print the same records
+    std::mutex drainLock;
+    std::atomic<uint64_t> written;
+    std::atomic<uint64_t> suppressed;
+
+    LogRegistry() : written(0), suppressed(0) {}
+};
+
+// Never destroyed: the detached logger thread and the exit flush can still drain while statics are torn down
+inline LogRegistry &logRegistry() {
+    static LogRegistry *registry = new LogRegistry();
+    return *registry;
+}
+
+// Owns the ring of the current thread and gives it back when the thread ends
+struct LogRingHandle {
+    LogRing *ring;
+
+    LogRingHandle() {
+        LogRegistry &registry = logRegistry();
+        std::lock_guard<std::mutex> guard(registry.lock);
+        if (!registry.free.empty()) {
+            ring = registry.free.back();
+            registry.free.pop_back();
+        } else {
+            ring = new LogRing();
+            registry.rings.push_back(ring);
+        }
+    }
+
+    ~LogRingHandle() {
+        LogRegistry &registry = logRegistry();
+        std::lock_guard<std::mutex> guard(registry.lock);
+        registry.free.push_back(ring);
+    }
+};
+
+inline LogRing &threadLogRing() {
+    static thread_local LogRingHandle handle;
+    return *handle.ring;
+}
+
+// Rate limit of one call site on one thread
+struct LogSite {
+    int64_t second = 0;
+    uint32_t count = 0;
+    uint32_t suppressed = 0;
+
+    bool allow(int64_t nanos) {
+        int64_t now = nanos / 1000000000;
+        if (now != second) {
+            second = now;
+            count = 0;
+        }
+        if (count >= logRatePerSecond) {
+            suppressed++;
+            return false;
+        }
+        count++;
+        return true;
+    }
+};
+
+inline int64_t logNanos() {
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// How an argument is copied into a record and handed back to the formatter
+template <typename T>
+struct LogArg {
+    typedef T Decoded;
+    static size_t size(const T &) { return sizeof(T); }
+    static void write(char *&out, const T &value) {
+        memcpy(out, &value, sizeof(T));
+        out += sizeof(T);
+    }
+    static T read(const char *&in) {
+        T value;
+        memcpy(&value, in, sizeof(T));
+        in += sizeof(T);
+        return value;
+    }
+};
+
+// Strings are copied with their terminating zero, the formatter gets a pointer into the record
+struct LogStringArg {
+    typedef const char *Decoded;
+    static size_t size(const char *value) { return sizeof(uint32_t) + strlen(value) + 1; }
+    static void write(char *&out, const char *value) {
+        uint32_t length = strlen(value) + 1;
+        memcpy(out, &length, sizeof(length));
+        memcpy(out + sizeof(length), value, length);
+        out += sizeof(length) + length;
+    }
+    static const char *read(const char *&in) {
+        uint32_t length;
+        memcpy(&length, in, sizeof(length));
+        const char *value = in + sizeof(length);
+        in += sizeof(length) + length;
+        return value;
+    }
+};
+
+template <>
+struct LogArg<const char *> : LogStringArg {};
+template <>
+struct LogArg<char *> : LogStringArg {};
+
+inline size_t logArgsSize() { return 0; }
+
+template <typename First, typename... Rest>
+size_t logArgsSize(const First &first, const Rest &... rest) {
+    return LogArg<typename std::decay<First>::type>::size(first) + logArgsSize(rest...);
+}
+
+inline void logWriteArgs(char *&) {}
+
+template <typename First, typename... Rest>
+void logWriteArgs(char *&out, const First &first, const Rest &... rest) {
+    LogArg<typename std::decay<First>::type>::write(out, first);
+    logWriteArgs(out, rest...);
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+#pragma GCC diagnostic ignored "-Wformat-security"
+// Read the arguments of a record back one type at a time, then format them all with the format of the call site
+template <typename... Args>
+struct LogDecode;
+
+template <>
+struct LogDecode<> {
+    template <typename... Values>
+    static void format(std::string &out, const char *format, const char *, Values... decoded) {
+        char line[512];
+        int length = snprintf(line, sizeof(line), format, decoded...);
+        if (length < 0) {
+            return;
+        }
+        if ((size_t)length < sizeof(line)) {
+            out.append(line, length);
+            return;
+        }
+        std::vector<char> longLine(length + 1);
+        snprintf(longLine.data(), longLine.size(), format, decoded...);
+        out.append(longLine.data(), length);
+    }
+};
+#pragma GCC diagnostic pop
+
+template <typename First, typename... Rest>
+struct LogDecode<First, Rest...> {
+    template <typename... Values>
+    static void format(std::string &out, const char *format, const char *args, Values... decoded) {
+        typename LogArg<First>::Decoded value = LogArg<First>::read(args);
+        LogDecode<Rest...>::format(out, format, args, decoded..., value);
+    }
+};
+
+template <typename... Args>
+void logFormat(std::string &out, const char *format, const char *args) {
+    LogDecode<Args...>::format(out, format, args);
+}
+
+// Copy a record into the ring of the current thread, format must be a string literal
+template <typename... Args>
+void logWrite(int level, LogSite &site, const char *format, const Args &... args) {
+    int64_t nanos = logNanos();
+    if (!site.allow(nanos)) {
+        return;
+    }
+    LogRing &ring = threadLogRing();
+    size_t size = (sizeof(LogRecord) + logArgsSize(args...) + 7) & ~(size_t)7;
+    char *slot = ring.reserve(size);
+    if (!slot) {
+        ring.dropped++;
+        return;
+    }
+    LogRecord record;
+    record.size = size;
+    record.suppressed = site.suppressed;
+    record.nanos = nanos;
+    record.formatter = logFormat<typename std::decay<Args>::type...>;
+    record.format = format;
+    record.level = level;
+    memcpy(slot, &record, sizeof(record));
+    char *out = slot + sizeof(record);
+    logWriteArgs(out, args...);
+    ring.commit();
+    site.suppressed = 0;
+}
+
+// Never called, lets the compiler check the format of a call site against its arguments
+inline void logCheckFormat(const char *, ...) __attribute__((format(printf, 1, 2)));
+inline void logCheckFormat(const char *, ...) {}
+
+#define LOG_AT(level, ...)                                                  \
+    do {                                                                    \
+        if (0) {                                                            \
+            logCheckFormat(__VA_ARGS__);                                    \
+        }                                                                   \
+        static thread_local LogSite logSite;                                \
+        if ((level) >= logLevel().load(std::memory_order_relaxed)) {        \
+            logWrite(level, logSite, __VA_ARGS__);                          \
+        }                                                                   \
+    } while (0)
+
+#if LOG_COMPILED_LEVEL <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) \
+    do {               \
+    } while (0)
+#endif
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+// Format and print every record waiting in the rings, in time order
+// Return the number of records printed
+inline size_t logDrain() {
+    LogRegistry &registry = logRegistry();
+    std::lock_guard<std::mutex> drain(registry.drainLock);
+    std::vector<LogRing *> rings;
+    {
+        std::lock_guard<std::mutex> guard(registry.lock);
+        rings = registry.rings;
+    }
+    std::vector<std::pair<int64_t, std::string> > lines;
+    for (size_t i = 0; i < rings.size(); i++) {
+        LogRing &ring = *rings[i];
+        size_t position = ring.head.load(std::memory_order_relaxed);
+        size_t tail = ring.tail.load(std::memory_order_acquire);
+        while (position < tail) {
+            size_t offset = position & (logRingSize - 1);
+            LogRecord record;
+            memcpy(&record, ring.data + offset, sizeof(record));
+            if (record.size == 0) {
+                position += logRingSize - offset;
+                continue;
+            }
+            time_t seconds = record.nanos / 1000000000;
+            tm local;
+            localtime_r(&seconds, &local);
+            char prefix[32];
+            snprintf(prefix, sizeof(prefix), "%02d:%02d:%02d.%06d %c ", local.tm_hour, local.tm_min, local.tm_sec,
+                     (int)(record.nanos % 1000000000 / 1000), "DIWE"[record.level]);
+            std::string line = prefix;
+            record.formatter(line, record.format, ring.data + offset + sizeof(record));
+            if (record.suppressed) {
+                line += " (" + std::to_string(record.suppressed) + " more suppressed)";
+                registry.suppressed += record.suppressed;
+            }
+            line += '\n';
+            lines.push_back(make_pair(record.nanos, std::move(line)));
+            position += record.size;
+        }
+        ring.head.store(position, std::memory_order_release);
+    }
+    std::stable_sort(lines.begin(), lines.end(),
+                     [](const std::pair<int64_t, std::string> &a, const std::pair<int64_t, std::string> &b) {
+                         return a.first < b.first;
+                     });
+    std::string text;
+    for (size_t i = 0; i < lines.size(); i++) {
+        text += lines[i].second;
+    }
+    if (!text.empty()) {
+        fwrite(text.data(), 1, text.size(), stdout);
+        fflush(stdout);
+    }
+    registry.written += lines.size();
+    return lines.size();
+}
+
+inline void logFlush() { logDrain(); }
+
+// Records dropped because the ring of their thread was full
+inline uint64_t logDropped() {
+    LogRegistry &registry = logRegistry();
+    std::lock_guard<std::mutex> guard(registry.lock);
+    uint64_t dropped = 0;
+    for (size_t i = 0; i < registry.rings.size(); i++) {
+        dropped += registry.rings[i]->dropped.load();
+    }
+    return dropped;
+}
+
+// Run time level named by KV_LOG_LEVEL, one of debug, info, warn or error, default info
+inline int logLevelFromEnv() {
+    const char *names[] = {"debug", "info", "warn", "error"};
+    const char *name = getenv("KV_LOG_LEVEL");
+    for (int level = LOG_LEVEL_DEBUG; name && level <= LOG_LEVEL_ERROR; level++) {
+        if (strcmp(name, names[level]) == 0) {
+            return level;
+        }
+    }
+    return LOG_LEVEL_INFO;
+}
+
+// Start the logger thread, records written on exit are flushed by it too
+inline void logStart() {
+    logLevel().store(logLevelFromEnv());
+    // Built before the exit flush is registered, so the flush never finds it missing
+    logRegistry();
+    std::thread([] {
+        while (true) {
+            if (logDrain() == 0) {
+                usleep(logIdleMicros);
+            }
+        }
+    }).detach();
+    atexit(logFlush);
+}
@@ -0,0 +1,201 @@
+#!/bin/bash
+# End to end run of a cluster on loopback, with the release server and client of this directory:
+# - write: writes through the client library, each replicated to the other holders of its key
+# - read: reads of the keys written
+# - legacy_read_your_writes: legacy messages write keys through every server and read them back from it, keys it is
+#   not a replica of included; the run fails if one reads back another value
+# - write_one_down: writes while the last server is stopped, its copies wait as hints
+# - recover: the last server is restarted and pulls what it missed from its peers, the hints its peers replay to it
+#   are counted too
+# - read_after_recover: reads once it is back
+# - anti_entropy: the last server is wiped and restarted without recovery, anti-entropy must bring back every key it
+#   held, and the round after must find nothing left to repair; the run fails otherwise
+# Every phase prints one JSON line on stdout, the client benchmark phases carry its report in "result".
+#
+# Usage: ./loopbench.sh [servers=5] [keys=20000] [seconds=5] [threads=4]
+# Servers listen on 127.0.0.1 from port 4531 up, their logs and files are kept in a temporary directory.
+set -e
+
+cd "$(dirname "$0")"
+root=$(pwd)
+servers=${1:-5}
+keys=${2:-20000}
+seconds=${3:-5}
+threads=${4:-4}
+basePort=4530
+
+if [ ! -x "$root/server" ] || [ ! -x "$root/client" ]; then
+    echo "Build server and client first: make" >&2
+    exit 1
+fi
+
+dir=$(mktemp -d)
+pids=()
+cleanup() {
+    for pid in "${pids[@]}"; do
+        kill "$pid" 2> /dev/null || true
+    done
+    wait 2> /dev/null || true
+    rm -rf "$dir"
+}
+trap cleanup EXIT
+
+for i in $(seq 1 "$servers"); do
+    echo "server$i=127.0.0.1:$((basePort + i))" >> "$dir/config.txt"
+done
+echo "replicas=3" >> "$dir/config.txt"
+export KV_CONFIG="$dir/config.txt"
+# The servers read commands from stdin, a fifo held open here never reaches end of file
+mkfifo "$dir/stdin"
+exec 3<> "$dir/stdin"
+
+# Start server $1, KV_RECOVER $2 (default 1)
+startServer() {
+    (cd "$dir" && export KV_RECOVER="${2:-1}" && exec "$root/server" "$1" 1 < "$dir/stdin" > "$dir/server$1.log" 2>&1) &
+    pids[$1]=$!
+    for attempt in $(seq 1 100); do
+        if "$root/client" stats "$1" > /dev/null 2>&1; then
+            return
+        fi
+        sleep 0.1
+    done
+    echo "Server $1 did not start, see $dir/server$1.log" >&2
+    exit 1
+}
+
+# Wait until every server sees all the others up, writes sent before would go to hints and fail
+waitHealthy() {
+    for attempt in $(seq 1 100); do
+        local down=0
+        for i in $(seq 1 "$servers"); do
+            if ! "$root/client" stats "$i" 2> /dev/null | grep -q "^connections"; then
+                down=1
+            elif "$root/client" stats "$i" | grep -q "^down "; then
+                down=1
+            fi
+        done
+        if [ $down = 0 ]; then
+            return
+        fi
+        sleep 0.1
+    done
+    echo "Servers do not see each other up, see $dir" >&2
+    exit 1
+}
+
+# Hints replayed to server $1 by all the others
+hintsReplayed() {
+    local total=0
+    for i in $(seq 1 "$servers"); do
+        if [ "$i" != "$1" ]; then
+            total=$((total + $("$root/client" stats "$i" | grep -o "replayed=[0-9]*" | grep -o "[0-9]*")))
+        fi
+    done
+    echo $total
+}
+
+# Keys in the store of server $1
+storeSize() {
+    "$root/client" stats "$1" | grep -o "store size=[0-9]*" | grep -o "[0-9]*"
+}
+
+# Differing leaves found by the anti-entropy rounds of all servers
+antiEntropyLeaves() {
+    local total=0
+    for i in $(seq 1 "$servers"); do
+        total=$((total + $("$root/client" stats "$i" | grep -o "anti-entropy leaves=[0-9]*" | grep -o "[0-9]*$")))
+    done
+    echo $total
+}
+
+# Send server $1 the legacy message {$2, $3, $4} on a connection of its own and print the value it answers
+legacyRequest() {
+    exec 5<> "/dev/tcp/127.0.0.1/$((basePort + $1))"
+    printf "$(printf '\\x%02x' $(($2 & 255)) $(($2 >> 8)) $(($3 & 255)) $(($3 >> 8)) $(($4 & 255)) $(($4 >> 8)))" >&5
+    head -c 2 <&5 | od -An -tu2 | tr -d ' '
+    exec 5<&-
+}
+
+clientBench() {
+    local result
+    result=$("$root/client" bench threads="$threads" seconds="$seconds" keys="$keys" reads="$2" | tail -1)
+    echo "{\"phase\": \"$1\", \"servers\": $servers, \"result\": $result}"
+}
+
+for i in $(seq 1 "$servers"); do
+    startServer "$i"
+done
+waitHealthy
+
+clientBench write 0
+clientBench read 1
+
+# Keys above the ones of the benchmarks, each server writes and reads its own
+legacyKeys=20
+for i in $(seq 1 "$servers"); do
+    for k in $(seq 1 "$legacyKeys"); do
+        key=$((60000 + i * legacyKeys + k))
+        if [ "$(legacyRequest "$i" 2 "$key" "$k")" != 1 ] || [ "$(legacyRequest "$i" 1 "$key" 0)" != "$k" ]; then
+            echo "Server $i does not read back the legacy write of key $key" >&2
+            exit 1
+        fi
+    done
+done
+echo "{\"phase\": \"legacy_read_your_writes\", \"servers\": $servers, \"keys\": $((servers * legacyKeys))}"
+
+kill "${pids[$servers]}"
+wait "${pids[$servers]}" 2> /dev/null || true
+clientBench write_one_down 0
+
+replayed=$(hintsReplayed "$servers")
+startServer "$servers"
+# Recovery runs in the background of a started server, its log tells the keys it took and how long it took
+for attempt in $(seq 1 600); do
+    line=$(grep -o "Recovered [0-9]* keys from [0-9]* servers in [0-9]* ms" "$dir/server$servers.log" || true)
+    if [ -n "$line" ]; then
+        break
+    fi
+    sleep 0.1
+done
+if [ -z "$line" ]; then
+    echo "Server $servers did not recover, see $dir/server$servers.log" >&2
+    exit 1
+fi
+waitHealthy
+# Peers also replay the writes they kept as hints when they see it back, whichever comes first the other finds
+# nothing newer
+set -- $line
+echo "{\"phase\": \"recover\", \"servers\": $servers, \"keys\": $2, \"peers\": $5, \"ms\": $8," \
+     "\"hints_replayed\": $(($(hintsReplayed "$servers") - replayed))}"
+
+clientBench read_after_recover 1
+
+expected=$(storeSize "$servers")
+kill "${pids[$servers]}"
+wait "${pids[$servers]}" 2> /dev/null || true
+rm -f "$dir"/wal-"$servers"-*.log "$dir"/snapshot-"$servers".dat*
+started=$(date +%s%N)
+startServer "$servers" 0
+waitHealthy
+# Peers compare their trees with it every antiEntropyInterval, 10s
+for attempt in $(seq 1 600); do
+    if [ "$(storeSize "$servers")" -ge "$expected" ]; then
+        break
+    fi
+    sleep 0.1
+done
+held=$(storeSize "$servers")
+if [ "$held" -lt "$expected" ]; then
+    echo "Anti-entropy brought back $held of $expected keys to server $servers, see $dir" >&2
+    exit 1
+fi
+ms=$((($(date +%s%N) - started) / 1000000))
+# Rounds already running when the last key came back may still find it, the ones after must find no difference
+sleep 11
+leaves=$(antiEntropyLeaves)
+sleep 11
+if [ "$(antiEntropyLeaves)" != "$leaves" ]; then
+    echo "Anti-entropy still finds differing leaves after server $servers got its keys back, see $dir" >&2
+    exit 1
+fi
+echo "{\"phase\": \"anti_entropy\", \"servers\": $servers, \"keys\": $expected, \"ms\": $ms}"
@@ -1,44 +1,257 @@
 #include <arpa/inet.h>
+#include <dirent.h>
 #include <execinfo.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <termios.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <csignal>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <memory>
 #include <mutex>
+#include <queue>
+#include <sstream>
+#include <string>
 #include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "cluster.h"
+#include "failure.h"
+#include "log.h"
+#include "merkle.h"
+#include "metrics.h"
+#include "protocol.h"
+#include "spsc.h"
+#include "store.h"
 using namespace std;
 
-// Socket Listening Port
-const int port = 4430;
+// Servers of the cluster and the ring placing keys on them, read from config.txt
+ClusterConfig cluster;
+HashRing ring;
 // Current Process ID
-char dcId;
+int dcId;
 // hostIndex
 int hostIndex;
-// Key store
-array<array<unsigned short int, 2>, 2000> store;
-int storeIndex = 0;
-// mutex for store
-mutex storeMutex;
-// Server Socket identifier
-int serverSocket;
-
-#define READ_REQUEST 1
-#define WRITE_REQUEST 2
-#define RECOVER_REQUEST 3
-#define RECOVER_WRITE 4
-#define REPLICATE_WRITE 5
-
-// declar array of strings
-array<char *, 7> hosts = {
-    "10.176.69.32", "10.176.69.33", "10.176.69.34", "10.176.69.35", "10.176.69.36", "10.176.69.37", "10.176.69.38",
+// Highest version stored per hash range
+array<atomic<uint64_t>, maxHosts> rangeHighWater;
+// The marks as the local snapshot and log left them, taken before any write from a peer comes in: recovery asks peers
+// for what is newer, live writes and hint replays arriving meanwhile would raise the marks past what we missed
+array<uint64_t, maxHosts> recoverySince;
+// Last hybrid logical clock value handed out or observed, without the host index bits
+atomic<uint64_t> hlcLast(0);
+// Number of shards, set by the second argument, one per core by default
+int shardCount = max(1, (int)thread::hardware_concurrency());
+// Length of the pending connections queue passed to listen()
+const int acceptBacklog = 1024;
+
+// Work handed to the thread of a shard
+typedef function<void()> ShardTask;
+// Tasks a shard can queue for another one before falling back to its locked inbox
+const int shardQueueSize = 1024;
+// Shared-nothing slice of the server: a thread pinned to a core with its own listener on the shared port
+// (SO_REUSEPORT), its own event loop and connections, and the keys that hash to it
+// Requests for keys of another shard are forwarded to it and answered back on the shard of the connection
+struct Shard {
+    int index;
+    int listener;
+    int epollFd;
+    // Wakes the event loop when a task is posted
+    int wakeFd;
+    Store store;
+    // Tasks from every other shard, queue i is only pushed by shard i
+    vector<SpscQueue<ShardTask> *> inbound;
+    // Tasks from threads that are not shards, or from a shard whose queue was full
+    mutex inboxLock;
+    vector<ShardTask> inbox;
+    // Tasks waiting for the log to be synced up to their sequence
+    vector<pair<uint64_t, ShardTask> > durableWaiters;
+};
+vector<Shard *> shards;
+// Shard of the current thread, -1 on threads that are not shards
+thread_local int currentShard = -1;
+
+// A client connection, and the bytes received on it that do not make a complete message yet
+// It belongs to the shard that accepted it, only that shard reads, answers or closes it
+struct Connection {
+    int socket;
+    int shard;
+    vector<char> buffer;
+    // Requests still running on other shards, a closed connection is freed once they are answered
+    int pending = 0;
+    // Replies the socket did not take yet, sent from outSent on as it drains
+    vector<char> out;
+    size_t outSent = 0;
+    // Not waiting in epoll: being served by its shard, or handed over to a recovery thread
+    bool serving = false;
+};
+// Bytes read from a connection per recv call
+const int connectionReadSize = 64 * 1024;
+// Reply bytes a connection may have waiting before it stops being read, a client that does not read its replies
+// only holds its own buffer and never blocks the shard
+const size_t connectionOutputLimit = 4 * 1024 * 1024;
+// Long lived connections to one peer, reused for replication and recovery
+struct PeerPool {
+    mutex lock;
+    vector<int> idle;
+};
+array<PeerPool, maxHosts> peerPools;
+// Idle connections kept open per peer, extra ones are closed when released
+const int peerPoolSize = 8;
+// Peers that stopped answering, replication and recovery skip them until they answer a heartbeat again
+FailureDetector peerHealth;
+// Deadlines of a connect and of a request to a peer, in milliseconds, a recovery stream gets much longer
+const int peerConnectTimeout = 200;
+const int peerRequestTimeout = 1000;
+const int recoverTimeout = 30000;
+// Milliseconds between two heartbeats to every neighbour
+const int heartbeatInterval = 250;
+
+// Replica writes a peer missed while it was down, as entries, replayed once it answers heartbeats again
+struct HintQueue {
+    mutex lock;
+    vector<char> entries;
+};
+array<HintQueue, maxHosts> hintQueues;
+// Bytes of hints kept per peer, the writes past it are left for the peer to pull when it recovers
+const size_t hintQueueBytes = 64 << 20;
+// Replica writes sent per batch when replaying hints
+const int hintReplayBatch = 256;
+// Merkle tree of every replica set we hold, NULL for the others
+vector<MerkleTree *> merkleTrees;
+// Milliseconds between two anti-entropy rounds, each compares every replica set we hold with its other holders
+const int antiEntropyInterval = 10000;
+// Leaves whose keys are asked for per request
+const int merkleLeavesPerRequest = 16;
+
+// Replica acks a write waits for before it is applied and acknowledged, set by the third argument
+// A request can ask for another consistency level
+int writeAcks = 1;
+// Threads talking to peers for the shards: the fetches of consistent reads
+const int peerThreadCount = 8;
+
+// Progress of one write while its replica writes are in flight, ready runs once when enough replicas answered
+// and is dropped after, so the write it holds can be freed
+struct WriteTicket {
+    mutex lock;
+    int acks = 0;
+    int replies = 0;
+    int replicas = 0;
+    int requiredAcks = 0;
+    bool fired = false;
+    function<void()> ready;
+};
+// A replica write for one peer
+struct ReplicaTask {
+    int peerIdx;
+    uint64_t key;
+    string value;
+    uint64_t version;
+    shared_ptr<WriteTicket> ticket;
+};
+// Replica writes waiting to go to one peer, sent as one OP_REPLICATE_BATCH by the replication thread of the peer
+struct ReplicationQueue {
+    mutex lock;
+    condition_variable ready;
+    vector<ReplicaTask> tasks;
+    size_t bytes = 0;
 };
+// Condition variables worker threads wait on are never destroyed: glibc blocks destroying one with waiters, which
+// would hang exit() while those threads are still parked on it
+array<ReplicationQueue, maxHosts> &replicationQueues = *new array<ReplicationQueue, maxHosts>();
+// Microseconds a batch waits for more writes after its first one, set by the fourth argument
+// Writes queued while a batch is in flight go in the next one whatever the window
+int replicationWindow = 200;
+// A batch is sent before the window ends once it holds this many writes or entry bytes
+const size_t replicationBatchWrites = 1024;
+const size_t replicationBatchBytes = 256 * 1024;
+// Work waiting for a peer thread
+queue<function<void()> > peerTasks;
+mutex peerTaskMutex;
+condition_variable &peerTaskCond = *new condition_variable();
+// Requests answered from our own state that take too long for a shard, such as walks over many keys, run on local
+// threads, which never wait for a peer: a peer thread waiting for our answer never waits for a busy peer thread
+const int localThreadCount = 2;
+queue<function<void()> > localTasks;
+mutex localTaskMutex;
+condition_variable &localTaskCond = *new condition_variable();
+
+// Write-ahead log: entries of applied writes waiting to be written, and counters of appended and synced records
+vector<char> walPending;
+uint64_t walAppended = 0;
+atomic<uint64_t> walDurable(0);
+mutex walMutex;
+condition_variable &walCond = *new condition_variable();
+condition_variable &walDurableCond = *new condition_variable();
+// Open log file and its generation, a snapshot moves writes to a new generation
+int walFile = -1;
+uint32_t walGeneration = 0;
+mutex walFileMutex;
+// Records logged since the last snapshot
+atomic<uint64_t> walSinceSnapshot(0);
+// A snapshot is taken every snapshotInterval seconds if anything was logged, or sooner once the log is this long
+const int snapshotInterval = 60;
+const uint64_t snapshotLogRecords = 1000000;
+
+// Header of a snapshot file, followed by its range table, its version marks, then count entries and their values
+// Entries are grouped by hash range and sorted by version inside a range, so the keys of a range changed after
+// some version are one contiguous tail of the file that recovery can send as is
+struct SnapshotHeader {
+    char magic[4];
+    uint32_t generation;
+    uint64_t count;
+    uint32_t ranges;
+    uint32_t marks;
+};
+// Where the entries of one hash range are in a snapshot file
+struct SnapshotRange {
+    uint64_t offset;
+    uint64_t length;
+    uint32_t firstMark;
+    uint32_t markCount;
+};
+// Version and file offset of every snapshotMarkInterval-th entry of a range
+struct SnapshotMark {
+    uint64_t version;
+    uint64_t offset;
+};
+const int snapshotMarkInterval = 256;
+// Bytes of entries written to a snapshot file at a time
+const size_t snapshotWriteChunk = 1 << 20;
+// Held while the snapshot is replaced and the logs it covers are dropped, and while recovery opens them
+mutex snapshotFilesMutex;
+// Bytes moved per splice call when receiving a recovery segment
+const size_t recoverSpliceSize = 1 << 20;
+
+// Length of the payload following a 6 byte header, -1 if the header announces more than a message may carry
+int trailerLength(const unsigned short int header[3]) {
+    switch (header[0]) {
+        case RECOVER_REQUEST:  // {r, hostIndex, ranges} + one since version per hash range
+            return header[2] <= maxHosts ? header[2] * sizeof(uint64_t) : -1;
+        default:
+            return 0;
+    }
+}
 
 int randNum(int min, int max) { return min + rand() % (max - min + 1); }
 
@@ -60,312 +273,2564 @@ char getChar() {
     return ch;
 }
 
-// Read key from store
-// Return value or 0 if not found
-unsigned short int readStore(unsigned short int key) {
-    for (int i = 0; i < storeIndex; i++) {
-        if (store[i][0] == key) {
-            return store[i][1];
+// Hash range of a key: the server owning it on the ring
+int hashKey(uint64_t key) { return ring.owner(key); }
+
+// Bytes of a value shown in logs
+int printLength(const string &value) { return min((int)value.size(), 32); }
+
+// Next version for a local write: milliseconds since epoch in the high 48 bits, a logical counter in bits 8..15
+// that keeps versions increasing within a millisecond or behind a faster peer clock, and our host index in bits 0..7
+uint64_t hlcNow() {
+    uint64_t physical = (uint64_t)chrono::duration_cast<chrono::milliseconds>(
+                            chrono::system_clock::now().time_since_epoch())
+                            .count()
+                        << 16;
+    uint64_t last = hlcLast.load();
+    uint64_t next;
+    do {
+        next = max(physical, (last | 0xFF) + 1);
+    } while (!hlcLast.compare_exchange_weak(last, next));
+    return next | hostIndex;
+}
+
+// Move our clock past a version received from a peer
+void hlcObserve(uint64_t version) {
+    uint64_t remote = version & ~(uint64_t)0xFF;
+    uint64_t last = hlcLast.load();
+    while (last < remote && !hlcLast.compare_exchange_weak(last, remote)) {
+    }
+}
+
+// Shard owning a key, hashed apart from the ring so the keys of every range spread over all shards
+int shardOf(uint64_t key) { return ringHash(key ^ 0x5DEECE66DULL) % shardCount; }
+
+Store &storeOf(uint64_t key) { return shards[shardOf(key)]->store; }
+
+// Read key from store, lock free
+// Return false if not found
+bool readStore(uint64_t key, string *value, uint64_t *version = NULL) { return storeOf(key).get(key, value, version); }
+
+// Value of a key as a legacy message carries it, 0 if not found
+unsigned short int legacyValue(uint8_t found, const string &value) {
+    return found == READ_FOUND ? strtoul(value.c_str(), NULL, 10) : 0;
+}
+
+// Put key into the store without propigation, conflicts are resolved by version: the newest one wins
+// Return PUT_APPENDED for a new key, PUT_UPDATED for a newer version of a key, PUT_STALE if we already have newer,
+// -1 if the value is too large or memory ran out
+int storePut(uint64_t key, const char *value, uint32_t length, uint64_t version) {
+    uint64_t replaced;
+    int result = storeOf(key).put(key, value, length, version, &replaced);
+    if (result == PUT_APPENDED || result == PUT_UPDATED) {
+        MerkleTree *tree = merkleTrees[ring.replicaSetOf(key)];
+        if (tree) {
+            tree->update(key, replaced, version);
+        }
+        // Raise the high-water mark of the key's range
+        atomic<uint64_t> &highWater = rangeHighWater[hashKey(key)];
+        uint64_t mark = highWater.load();
+        while (mark < version && !highWater.compare_exchange_weak(mark, version)) {
+        }
+    }
+    return result;
+}
+
+// Stores of every shard, to open a snapshot of
+vector<Store *> shardStores() {
+    vector<Store *> stores;
+    for (size_t i = 0; i < shards.size(); i++) {
+        stores.push_back(&shards[i]->store);
+    }
+    return stores;
+}
+
+// Call fn(key, value, length, version) for every key we hold in a leaf of the tree of a replica set, as it was at
+// epoch
+template <typename Fn>
+void forEachLeafKey(int set, uint32_t leaf, uint64_t epoch, Fn fn) {
+    for (size_t i = 0; i < shards.size(); i++) {
+        shards[i]->store.forEachWithHashBits(
+            leaf, merkleDepth,
+            [&](uint64_t key, const char *value, uint32_t length, uint64_t version) {
+                if (ring.replicaSetOf(key) == set) {
+                    fn(key, value, length, version);
+                }
+            },
+            epoch);
+    }
+}
+
+// Call fn(key, value, length, version) for every key of every shard as they all were when it started
+// Writes carry on meanwhile, the values they replace are kept until the walk is done
+template <typename Fn>
+void forEachStoreKey(Fn fn) {
+    StoreSnapshot snapshot(shardStores());
+    snapshot.forEach(fn);
+}
+
+size_t storeCount() {
+    size_t count = 0;
+    for (size_t i = 0; i < shards.size(); i++) {
+        count += shards[i]->store.count;
+    }
+    return count;
+}
+
+// Wake the event loop of a shard
+void wakeShard(int index) {
+    uint64_t one = 1;
+    write(shards[index]->wakeFd, &one, sizeof(one));
+}
+
+// Queue a task for the thread of a shard, it runs after the current task even when posted to our own shard
+void postToShard(int index, ShardTask task) {
+    Shard &shard = *shards[index];
+    if (currentShard < 0 || !shard.inbound[currentShard]->push(task)) {
+        lock_guard<mutex> lock(shard.inboxLock);
+        shard.inbox.push_back(move(task));
+    }
+    wakeShard(index);
+}
+
+// Run a task on the thread of a shard, right away if we are on it
+void runOnShard(int index, ShardTask task) {
+    if (index == currentShard) {
+        task();
+    } else {
+        postToShard(index, move(task));
+    }
+}
+
+// Run a task on the current shard once the log is synced up to sequence
+void afterDurable(uint64_t sequence, ShardTask task) {
+    if (walDurable >= sequence) {
+        task();
+    } else {
+        shards[currentShard]->durableWaiters.push_back(make_pair(sequence, move(task)));
+    }
+}
+
+string walPath(uint32_t generation) { return "wal-" + to_string(dcId) + "-" + to_string(generation) + ".log"; }
+
+string snapshotPath() { return "snapshot-" + to_string(dcId) + ".dat"; }
+
+// Open the log file of a new generation, writes logged from now on go to it
+void walOpen(uint32_t generation) {
+    int file = open(walPath(generation).c_str(), O_WRONLY | O_CREAT | O_APPEND | O_TRUNC, 0644);
+    if (file < 0) {
+        LOG_ERROR("[L] Error opening %s: %s", walPath(generation).c_str(), strerror(errno));
+        exit(1);
+    }
+    lock_guard<mutex> lock(walFileMutex);
+    if (walFile >= 0) {
+        close(walFile);
+    }
+    walFile = file;
+    walGeneration = generation;
+}
+
+// Add count applied writes, encoded as entries, to the log, return the sequence number to wait for with walWait
+uint64_t walAppend(const char *entries, size_t length, size_t count) {
+    {
+        lock_guard<mutex> lock(walMutex);
+        walPending.insert(walPending.end(), entries, entries + length);
+        walAppended += count;
+        count = walAppended;
+    }
+    walCond.notify_one();
+    return count;
+}
+
+// Wait until the log is synced to disk up to a sequence number
+void walWait(uint64_t sequence) {
+    unique_lock<mutex> lock(walMutex);
+    walDurableCond.wait(lock, [&] { return walDurable >= sequence; });
+}
+
+// Log writer thread, group commit: everything appended while the previous batch was syncing is written and
+// synced together, and every write waiting on it is released at once
+void walThread() {
+    vector<char> batch;
+    uint64_t synced = 0;
+    while (true) {
+        uint64_t sequence;
+        {
+            unique_lock<mutex> lock(walMutex);
+            walCond.wait(lock, [] { return !walPending.empty(); });
+            batch.swap(walPending);
+            sequence = walAppended;
+        }
+        {
+            lock_guard<mutex> lock(walFileMutex);
+            const char *data = batch.data();
+            size_t length = batch.size();
+            while (length > 0) {
+                ssize_t written = write(walFile, data, length);
+                if (written < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    LOG_ERROR("[L] Log write failed: %s", strerror(errno));
+                    exit(1);
+                }
+                data += written;
+                length -= written;
+            }
+            // A failed sync may have lost the batch, nothing in it can be acknowledged
+            if (fdatasync(walFile) < 0) {
+                LOG_ERROR("[L] Log sync failed: %s", strerror(errno));
+                exit(1);
+            }
+        }
+        walSinceSnapshot += sequence - synced;
+        synced = sequence;
+        batch.clear();
+        {
+            lock_guard<mutex> lock(walMutex);
+            walDurable = sequence;
+        }
+        walDurableCond.notify_all();
+        // Shards answer the writes that were waiting for this sync
+        for (size_t i = 0; i < shards.size(); i++) {
+            wakeShard(i);
+        }
+    }
+}
+
+// Write length bytes at offset of a file
+// Return false if it could not
+bool writeAt(int file, const char *data, size_t length, uint64_t offset) {
+    while (length > 0) {
+        ssize_t written = pwrite(file, data, length, offset);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        length -= written;
+        offset += written;
+    }
+    return true;
+}
+
+// Sync the directory holding the snapshot and the logs, so a rename in it survives a crash
+bool syncDataDirectory() {
+    int directory = open(".", O_RDONLY | O_DIRECTORY);
+    if (directory < 0) {
+        return false;
+    }
+    bool synced = fsync(directory) == 0;
+    close(directory);
+    return synced;
+}
+
+// Write the whole store to a new snapshot and drop the log generations it covers
+// Ranges are gathered and written one after the other from one store snapshot, only one range is held in memory
+void takeSnapshot() {
+    auto started = chrono::steady_clock::now();
+    // Writes logged after the switch go to the new generation, every write logged before it is already in the store
+    uint32_t previousGeneration = walGeneration;
+    walOpen(previousGeneration + 1);
+    walSinceSnapshot = 0;
+
+    string temporaryPath = snapshotPath() + ".tmp";
+    int file = open(temporaryPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file < 0) {
+        LOG_ERROR("[L] Error opening %s: %s", temporaryPath.c_str(), strerror(errno));
+        return;
+    }
+    int ranges = cluster.hosts.size();
+    StoreSnapshot snapshot(shardStores());
+    // The marks come before the entries, a first walk counts the keys of every range to place them
+    vector<uint64_t> rangeCounts(ranges, 0);
+    snapshot.forEach([&](uint64_t key, const char *, uint32_t, uint64_t) { rangeCounts[hashKey(key)]++; });
+    uint64_t count = 0;
+    size_t markCount = 0;
+    for (int range = 0; range < ranges; range++) {
+        count += rangeCounts[range];
+        markCount += (rangeCounts[range] + snapshotMarkInterval - 1) / snapshotMarkInterval;
+    }
+    vector<SnapshotRange> table(ranges);
+    uint64_t marksOffset = sizeof(SnapshotHeader) + ranges * sizeof(SnapshotRange);
+    uint64_t offset = marksOffset + markCount * sizeof(SnapshotMark);
+    uint32_t firstMark = 0;
+    bool written = true;
+    // Lay each range out oldest version first
+    for (int range = 0; range < ranges && written; range++) {
+        vector<char> rangeEntries;
+        vector<pair<uint64_t, size_t> > rangeOrder;
+        snapshot.forEach([&](uint64_t key, const char *value, uint32_t length, uint64_t version) {
+            if (hashKey(key) == range) {
+                rangeOrder.push_back(make_pair(version, rangeEntries.size()));
+                appendEntry(rangeEntries, key, value, length, version);
+            }
+        });
+        if (rangeOrder.size() != rangeCounts[range]) {
+            LOG_ERROR("[L] Snapshot range %d changed while written", range);
+            written = false;
+            break;
+        }
+        sort(rangeOrder.begin(), rangeOrder.end());
+        table[range].offset = offset;
+        table[range].firstMark = firstMark;
+        vector<SnapshotMark> marks;
+        vector<char> chunk;
+        uint64_t chunkOffset = offset;
+        for (size_t i = 0; i < rangeOrder.size() && written; i++) {
+            if (i % snapshotMarkInterval == 0) {
+                SnapshotMark mark;
+                mark.version = rangeOrder[i].first;
+                mark.offset = chunkOffset + chunk.size();
+                marks.push_back(mark);
+            }
+            const char *entry = rangeEntries.data() + rangeOrder[i].second;
+            StoreEntry header;
+            memcpy(&header, entry, sizeof(header));
+            chunk.insert(chunk.end(), entry, entry + sizeof(header) + header.length);
+            if (chunk.size() >= snapshotWriteChunk || i + 1 == rangeOrder.size()) {
+                written = writeAt(file, chunk.data(), chunk.size(), chunkOffset);
+                chunkOffset += chunk.size();
+                chunk.clear();
+            }
+        }
+        written = written && writeAt(file, (const char *)marks.data(), marks.size() * sizeof(SnapshotMark),
+                                     marksOffset + firstMark * sizeof(SnapshotMark));
+        table[range].length = chunkOffset - offset;
+        table[range].markCount = marks.size();
+        offset = chunkOffset;
+        firstMark += marks.size();
+    }
+    SnapshotHeader header;
+    memcpy(header.magic, "KVS3", 4);
+    header.generation = previousGeneration + 1;
+    header.count = count;
+    header.ranges = ranges;
+    header.marks = markCount;
+    written = written && writeAt(file, (const char *)&header, sizeof(header), 0) &&
+              writeAt(file, (const char *)table.data(), ranges * sizeof(SnapshotRange), sizeof(header));
+    if (!written || fsync(file) < 0) {
+        LOG_ERROR("[L] Snapshot write failed: %s", strerror(errno));
+        close(file);
+        unlink(temporaryPath.c_str());
+        return;
+    }
+    close(file);
+    {
+        lock_guard<mutex> lock(snapshotFilesMutex);
+        if (rename(temporaryPath.c_str(), snapshotPath().c_str()) < 0) {
+            LOG_ERROR("[L] Error renaming %s: %s", temporaryPath.c_str(), strerror(errno));
+            unlink(temporaryPath.c_str());
+            return;
+        }
+        // The logs it covers only go once the new snapshot is sure to be found after a crash
+        if (!syncDataDirectory()) {
+            LOG_ERROR("[L] Error syncing the data directory, keeping the logs: %s", strerror(errno));
+            return;
+        }
+        for (uint32_t generation = 0; generation <= previousGeneration; generation++) {
+            unlink(walPath(generation).c_str());
+        }
+    }
+    long elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - started).count();
+    LOG_INFO("[L] Snapshot of %llu keys taken in %ld ms", (unsigned long long)count, elapsed);
+}
+
+// Snapshot thread, keeps the log short so a restart replays little of it
+void snapshotThread() {
+    auto lastSnapshot = chrono::steady_clock::now();
+    while (true) {
+        sleep(1);
+        long elapsed = chrono::duration_cast<chrono::seconds>(chrono::steady_clock::now() - lastSnapshot).count();
+        if ((elapsed >= snapshotInterval && walSinceSnapshot > 0) || walSinceSnapshot >= snapshotLogRecords) {
+            takeSnapshot();
+            lastSnapshot = chrono::steady_clock::now();
+        }
+    }
+}
+
+// Map a file and merge its entries into the store, skipping header bytes
+// Return the number of entries loaded, a torn entry at the end of a log is ignored
+size_t loadEntries(const string &path, size_t headerLength, uint64_t *maxVersion) {
+    int file = open(path.c_str(), O_RDONLY);
+    if (file < 0) {
+        return 0;
+    }
+    struct stat info;
+    size_t count = 0;
+    if (fstat(file, &info) == 0 && (size_t)info.st_size > headerLength) {
+        void *data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+        if (data != MAP_FAILED) {
+            madvise(data, info.st_size, MADV_SEQUENTIAL);
+            const char *entries = (const char *)data + headerLength;
+            const char *end = (const char *)data + info.st_size;
+            StoreEntry entry;
+            const char *value;
+            while (readEntry(entries, end, &entry, &value)) {
+                storePut(entry.key, value, entry.length, entry.version);
+                *maxVersion = max(*maxVersion, entry.version);
+                count++;
+            }
+            munmap(data, info.st_size);
+        }
+    }
+    close(file);
+    return count;
+}
+
+// Restore the store from the last snapshot and the log written after it, then start logging to a new generation
+void loadLocalState() {
+    auto started = chrono::steady_clock::now();
+    uint64_t maxVersion = 0;
+    uint32_t firstGeneration = 0;
+    size_t snapshotKeys = 0;
+    int file = open(snapshotPath().c_str(), O_RDONLY);
+    if (file >= 0) {
+        SnapshotHeader header;
+        if (read(file, &header, sizeof(header)) == sizeof(header) && memcmp(header.magic, "KVS3", 4) == 0) {
+            firstGeneration = header.generation;
+            size_t headerLength =
+                sizeof(header) + header.ranges * sizeof(SnapshotRange) + header.marks * sizeof(SnapshotMark);
+            snapshotKeys = loadEntries(snapshotPath(), headerLength, &maxVersion);
+        } else {
+            LOG_WARN("[L] Ignoring invalid snapshot %s", snapshotPath().c_str());
+        }
+        close(file);
+    }
+
+    // Replay every log generation the snapshot does not cover, versions make the order irrelevant
+    uint32_t lastGeneration = firstGeneration;
+    size_t logRecords = 0;
+    string prefix = "wal-" + to_string(dcId) + "-";
+    DIR *directory = opendir(".");
+    if (directory) {
+        dirent *item;
+        while ((item = readdir(directory)) != NULL) {
+            string name = item->d_name;
+            if (name.compare(0, prefix.size(), prefix) != 0) {
+                continue;
+            }
+            uint32_t generation = strtoul(name.c_str() + prefix.size(), NULL, 10);
+            if (generation < firstGeneration) {
+                unlink(name.c_str());
+                continue;
+            }
+            logRecords += loadEntries(name, 0, &maxVersion);
+            lastGeneration = max(lastGeneration, generation);
+        }
+        closedir(directory);
+    }
+    hlcObserve(maxVersion);
+    walOpen(lastGeneration + 1);
+    long elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - started).count();
+    LOG_INFO("[L] Loaded %d keys from snapshot and %d log records in %ld ms", (int)snapshotKeys, (int)logRecords,
+           elapsed);
+}
+
+// Check if a host keeps a copy of key
+bool isKeyRelatedToHost(uint64_t key, int recoverHostIndex) { return ring.isReplica(key, recoverHostIndex); }
+
+// Send the whole buffer, looping over partial writes
+bool sendAll(int socket, const void *buffer, size_t length) {
+    const char *data = (const char *)buffer;
+    while (length > 0) {
+        ssize_t sent = send(socket, data, length, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += sent;
+        length -= sent;
+    }
+    return true;
+}
+
+// Switch a socket between blocking calls, for threads that stream on it, and non-blocking ones, for the shards
+void setBlocking(int socket, bool blocking) {
+    int flags = fcntl(socket, F_GETFL, 0);
+    fcntl(socket, F_SETFL, blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK);
+}
+
+// Note that a peer failed, it is skipped until it answers a heartbeat
+void markPeerDown(int peerIdx) {
+    if (peerHealth.failed(peerIdx)) {
+        LOG_WARN("[HB] Server %d is down", peerIdx + 1);
+    }
+}
+
+void markPeerUp(int peerIdx) {
+    if (peerHealth.heard(peerIdx)) {
+        LOG_INFO("[HB] Server %d is back", peerIdx + 1);
+    }
+}
+
+// Open a new connection to a peer
+// Return the socket or -1 if the peer is unreachable
+int connectPeer(int peerIdx) {
+    // A powered off peer never answers the handshake, dont wait for the kernel to give up on it
+    int peerSocket = connectWithDeadline(cluster.hosts[peerIdx], cluster.ports[peerIdx], peerConnectTimeout);
+    if (peerSocket < 0) {
+        LOG_WARN("[P] Error connecting to %s: %s", cluster.hosts[peerIdx].c_str(), strerror(errno));
+        markPeerDown(peerIdx);
+        return -1;
+    }
+    setSocketDeadline(peerSocket, peerRequestTimeout);
+    // Requests are small and wait for their reply, dont let Nagle hold them back
+    int opt = 1;
+    setsockopt(peerSocket, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    return peerSocket;
+}
+
+// Health check of an idle connection: nothing must be pending on it, and the peer must not have closed it
+bool isPeerConnectionHealthy(int peerSocket) {
+    char probe;
+    int rbyteCount = recv(peerSocket, &probe, 1, MSG_PEEK | MSG_DONTWAIT);
+    return rbyteCount < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+// Take a connection to a peer from the pool, or open a new one if none is idle
+// Set reused to tell the caller whether the connection came from the pool
+// Return the socket or -1 if the peer is unreachable
+int acquirePeer(int peerIdx, bool *reused = NULL) {
+    PeerPool &pool = peerPools[peerIdx];
+    {
+        lock_guard<mutex> lock(pool.lock);
+        while (!pool.idle.empty()) {
+            int peerSocket = pool.idle.back();
+            pool.idle.pop_back();
+            if (isPeerConnectionHealthy(peerSocket)) {
+                if (reused) {
+                    *reused = true;
+                }
+                return peerSocket;
+            }
+            close(peerSocket);
+        }
+    }
+    if (reused) {
+        *reused = false;
+    }
+    return connectPeer(peerIdx);
+}
+
+// Give a connection back to the pool once its request is fully answered
+void releasePeer(int peerIdx, int peerSocket) {
+    PeerPool &pool = peerPools[peerIdx];
+    {
+        lock_guard<mutex> lock(pool.lock);
+        if ((int)pool.idle.size() < peerPoolSize) {
+            pool.idle.push_back(peerSocket);
+            return;
+        }
+    }
+    close(peerSocket);
+}
+
+// Send a request to a peer over a pooled connection and read its reply with readReply, within the deadline
+// A pooled connection the peer dropped is replaced by a fresh one and the request is sent again
+// Return false if the peer could not be reached or did not reply in time
+bool peerExchange(int peerIdx, const vector<char> &request, function<bool(int)> readReply) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        bool reused;
+        int peerSocket = acquirePeer(peerIdx, &reused);
+        if (peerSocket < 0) {
+            return false;
+        }
+        if (sendAll(peerSocket, request.data(), request.size()) && readReply(peerSocket)) {
+            releasePeer(peerIdx, peerSocket);
+            markPeerUp(peerIdx);
+            return true;
+        }
+        LOG_WARN("[P] Request to %s failed: %s", cluster.hosts[peerIdx].c_str(), strerror(errno));
+        close(peerSocket);
+        if (!reused) {
+            // A brand new connection failed or timed out, the peer itself is not answering
+            markPeerDown(peerIdx);
+            return false;
+        }
+    }
+    return false;
+}
+
+// Send a request to a peer and wait for a reply of replyLength bytes
+bool peerRequest(int peerIdx, const vector<char> &request, void *reply, int replyLength) {
+    return peerExchange(peerIdx, request,
+                        [&](int peerSocket) { return recv(peerSocket, reply, replyLength, MSG_WAITALL) == replyLength; });
+}
+
+// Send a request to a peer and wait for a whole reply frame, setting payload to what follows its header
+bool peerFrameRequest(int peerIdx, const vector<char> &request, vector<char> *payload) {
+    return peerExchange(peerIdx, request, [&](int peerSocket) {
+        FrameHeader header;
+        if (recv(peerSocket, &header, sizeof(header), MSG_WAITALL) != sizeof(header) || header.magic != FRAME_MAGIC ||
+            header.length > maxFramePayload) {
+            return false;
+        }
+        payload->resize(header.length);
+        return header.length == 0 ||
+               recv(peerSocket, payload->data(), header.length, MSG_WAITALL) == (ssize_t)header.length;
+    });
+}
+
+// Keep a replica write a peer did not get, it is replayed when the peer answers heartbeats again
+void queueHint(const ReplicaTask &task) {
+    HintQueue &queue = hintQueues[task.peerIdx];
+    lock_guard<mutex> lock(queue.lock);
+    if (queue.entries.size() + sizeof(StoreEntry) + task.value.size() > hintQueueBytes) {
+        addCounter(COUNTER_HINTS_DROPPED);
+        return;
+    }
+    appendEntry(queue.entries, task.key, task.value.data(), task.value.size(), task.version);
+    addCounter(COUNTER_HINTS_QUEUED);
+}
+
+// Append an OP_REPLICATE_BATCH frame of count entries to request
+void appendReplicateBatch(vector<char> &request, const vector<char> &entries, unsigned short count) {
+    size_t start = beginFrame(request, OP_REPLICATE_BATCH, 0);
+    appendField(request, count);
+    request.insert(request.end(), entries.begin(), entries.end());
+    endFrame(request, start);
+}
+
+// Send an OP_REPLICATE_BATCH to a peer and set acked to its ok bytes, the peer acks once the batch is logged
+// Return false if the peer did not answer every entry
+bool replicateBatchRequest(int peerIdx, const vector<char> &request, unsigned short count, vector<uint8_t> *acked) {
+    vector<char> payload;
+    if (!peerFrameRequest(peerIdx, request, &payload)) {
+        return false;
+    }
+    const char *data = payload.data();
+    unsigned short replied;
+    if (!readField(data, payload.data() + payload.size(), &replied) || replied != count ||
+        payload.size() < sizeof(replied) + count) {
+        return false;
+    }
+    acked->assign(data, data + count);
+    return true;
+}
+
+// Send a peer that is back the replica writes it missed, in OP_REPLICATE_BATCH requests
+// What a failed batch did not deliver is kept for the next heartbeat
+void replayHints(int peerIdx) {
+    HintQueue &queue = hintQueues[peerIdx];
+    vector<char> entries;
+    {
+        lock_guard<mutex> lock(queue.lock);
+        entries.swap(queue.entries);
+    }
+    const char *data = entries.data();
+    const char *end = data + entries.size();
+    size_t replayed = 0;
+    while (data < end) {
+        const char *batch = data;
+        int count = 0;
+        StoreEntry entry;
+        const char *value;
+        const char *next = data;
+        while (count < hintReplayBatch && readEntry(next, end, &entry, &value) &&
+               next - batch + sizeof(unsigned short) <= maxFramePayload) {
+            data = next;
+            count++;
+        }
+        vector<char> request;
+        appendReplicateBatch(request, vector<char>(batch, data), count);
+        vector<uint8_t> acked;
+        if (!count || !replicateBatchRequest(peerIdx, request, count, &acked)) {
+            lock_guard<mutex> lock(queue.lock);
+            queue.entries.insert(queue.entries.end(), batch, end);
+            break;
+        }
+        replayed += count;
+    }
+    if (replayed > 0) {
+        addCounter(COUNTER_HINTS_REPLAYED, replayed);
+        LOG_INFO("[HB] Replayed %d missed writes to server %d", (int)replayed, peerIdx + 1);
+    }
+}
+
+// Heartbeat thread: pings every neighbour, a peer that does not answer in time is marked down and one that answers
+// is marked up and given the writes it missed
+void heartbeatThread() {
+    vector<int> peers = ring.neighbours(hostIndex);
+    vector<char> request;
+    endFrame(request, beginFrame(request, OP_PING, 0));
+    FrameHeader reply;
+    while (true) {
+        for (size_t i = 0; i < peers.size(); i++) {
+            if (peerRequest(peers[i], request, &reply, sizeof(reply))) {
+                replayHints(peers[i]);
+            }
+        }
+        usleep(heartbeatInterval * 1000);
+    }
+}
+
+// Peer thread, runs the queued peer tasks one at a time, each may wait for a peer up to its deadline
+void peerThread() {
+    while (true) {
+        function<void()> task;
+        {
+            unique_lock<mutex> lock(peerTaskMutex);
+            peerTaskCond.wait(lock, [] { return !peerTasks.empty(); });
+            task = move(peerTasks.front());
+            peerTasks.pop();
+        }
+        task();
+    }
+}
+
+void runOnPeerThread(function<void()> task) {
+    {
+        lock_guard<mutex> lock(peerTaskMutex);
+        peerTasks.push(move(task));
+    }
+    peerTaskCond.notify_one();
+}
+
+// Local thread, runs the queued local tasks one at a time
+void localThread() {
+    while (true) {
+        function<void()> task;
+        {
+            unique_lock<mutex> lock(localTaskMutex);
+            localTaskCond.wait(lock, [] { return !localTasks.empty(); });
+            task = move(localTasks.front());
+            localTasks.pop();
+        }
+        task();
+    }
+}
+
+void runOnLocalThread(function<void()> task) {
+    {
+        lock_guard<mutex> lock(localTaskMutex);
+        localTasks.push(move(task));
+    }
+    localTaskCond.notify_one();
+}
+
+// Report the outcome of one replica write to the write waiting for it
+void replicaReplied(WriteTicket &ticket, bool acked) {
+    function<void()> ready;
+    {
+        lock_guard<mutex> lock(ticket.lock);
+        ticket.replies++;
+        if (acked) {
+            ticket.acks++;
+        }
+        // Answer as soon as enough replicas acked, the remaining ones finish in the background
+        if (!ticket.fired && (ticket.acks >= ticket.requiredAcks || ticket.replies == ticket.replicas)) {
+            ticket.fired = true;
+            ready.swap(ticket.ready);
+        }
+    }
+    if (ready) {
+        ready();
+    }
+}
+
+// Send a batch of replica writes to a peer as one request and report the outcome to the writes waiting for them
+// A key written more than once in the batch is only sent with its newest version, and its writes share that outcome
+void replicateBatch(int peerIdx, const vector<ReplicaTask> &batch) {
+    // Position in sent of every key, and the task sent for it
+    unordered_map<uint64_t, size_t> positions;
+    vector<size_t> sent;
+    for (size_t i = 0; i < batch.size(); i++) {
+        auto found = positions.find(batch[i].key);
+        if (found == positions.end()) {
+            positions[batch[i].key] = sent.size();
+            sent.push_back(i);
+        } else if (batch[i].version > batch[sent[found->second]].version) {
+            sent[found->second] = i;
+        }
+    }
+    addCounter(COUNTER_REPLICATION_COALESCED, batch.size() - sent.size());
+    vector<uint8_t> acked(sent.size(), 0);
+    // A peer known to be down is not waited for, it gets the writes when it is back
+    if (!peerHealth.isDown(peerIdx)) {
+        LOG_DEBUG("[RW] Propigate %d writes to %s", (int)sent.size(), cluster.hosts[peerIdx].c_str());
+        vector<char> entries;
+        for (size_t i = 0; i < sent.size(); i++) {
+            const ReplicaTask &task = batch[sent[i]];
+            appendEntry(entries, task.key, task.value.data(), task.value.size(), task.version);
+        }
+        vector<char> request;
+        appendReplicateBatch(request, entries, sent.size());
+        auto started = chrono::steady_clock::now();
+        if (replicateBatchRequest(peerIdx, request, sent.size(), &acked)) {
+            recordLatency(METRIC_PROPAGATE + peerIdx, started);
+            addCounter(COUNTER_REPLICATION_BATCHES);
+            addCounter(COUNTER_REPLICATION_WRITES, sent.size());
+            LOG_DEBUG("[RW] Successful propigation to %s", cluster.hosts[peerIdx].c_str());
+        }
+    }
+    for (size_t i = 0; i < sent.size(); i++) {
+        if (!acked[i]) {
+            addCounter(COUNTER_PROPAGATE_ERRORS + peerIdx);
+            queueHint(batch[sent[i]]);
+        }
+    }
+    for (size_t i = 0; i < batch.size(); i++) {
+        replicaReplied(*batch[i].ticket, acked[positions[batch[i].key]]);
+    }
+}
+
+// Queue a replica write for the replication thread of its peer
+void queueReplica(const ReplicaTask &task) {
+    ReplicationQueue &queue = replicationQueues[task.peerIdx];
+    {
+        lock_guard<mutex> lock(queue.lock);
+        queue.tasks.push_back(task);
+        queue.bytes += sizeof(StoreEntry) + task.value.size();
+    }
+    queue.ready.notify_one();
+}
+
+// Replication thread of one peer: waits for a first write, gives the window to more writes, then sends them all as
+// one batch and waits for its ack, so a single batch per peer is in flight
+void replicationThread(int peerIdx) {
+    ReplicationQueue &queue = replicationQueues[peerIdx];
+    while (true) {
+        vector<ReplicaTask> batch;
+        {
+            unique_lock<mutex> lock(queue.lock);
+            queue.ready.wait(lock, [&] { return !queue.tasks.empty(); });
+            queue.ready.wait_for(lock, chrono::microseconds(replicationWindow), [&] {
+                return queue.tasks.size() >= replicationBatchWrites || queue.bytes >= replicationBatchBytes;
+            });
+            // Take what fits in a frame, the rest waits for the next batch
+            size_t taken = 0;
+            size_t bytes = sizeof(unsigned short);
+            while (taken < queue.tasks.size() && taken < replicationBatchWrites) {
+                size_t entryBytes = sizeof(StoreEntry) + queue.tasks[taken].value.size();
+                if (bytes + entryBytes > maxFramePayload) {
+                    break;
+                }
+                bytes += entryBytes;
+                taken++;
+            }
+            batch.assign(make_move_iterator(queue.tasks.begin()), make_move_iterator(queue.tasks.begin() + taken));
+            queue.tasks.erase(queue.tasks.begin(), queue.tasks.begin() + taken);
+            queue.bytes -= bytes - sizeof(unsigned short);
+        }
+        replicateBatch(peerIdx, batch);
+    }
+}
+
+// Ask a peer for the hashes of nodes of its tree of a replica set
+bool fetchMerkleNodes(int peerIdx, int set, const vector<uint32_t> &nodes, vector<uint64_t> *hashes) {
+    vector<char> request;
+    size_t start = beginFrame(request, OP_MERKLE_NODES, 0);
+    appendField<uint16_t>(request, set);
+    appendField<unsigned short>(request, nodes.size());
+    for (size_t i = 0; i < nodes.size(); i++) {
+        appendField(request, nodes[i]);
+    }
+    endFrame(request, start);
+    vector<char> payload;
+    if (!peerFrameRequest(peerIdx, request, &payload)) {
+        return false;
+    }
+    const char *data = payload.data();
+    const char *end = data + payload.size();
+    unsigned short count;
+    if (!readField(data, end, &count) || count != nodes.size()) {
+        return false;
+    }
+    hashes->resize(count);
+    for (int i = 0; i < count; i++) {
+        if (!readField(data, end, &(*hashes)[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Ask a peer for the versions of the keys it holds in leaves of its tree of a replica set
+// Set answered to the number of leading leaves it sent the keys of
+bool fetchMerkleKeys(int peerIdx, int set, const vector<uint32_t> &leaves, size_t *answered,
+                     unordered_map<uint64_t, uint64_t> *versions) {
+    vector<char> request;
+    size_t start = beginFrame(request, OP_MERKLE_KEYS, 0);
+    appendField<uint16_t>(request, set);
+    appendField<unsigned short>(request, leaves.size());
+    for (size_t i = 0; i < leaves.size(); i++) {
+        appendField(request, leaves[i]);
+    }
+    endFrame(request, start);
+    vector<char> payload;
+    if (!peerFrameRequest(peerIdx, request, &payload)) {
+        return false;
+    }
+    const char *data = payload.data();
+    const char *end = data + payload.size();
+    unsigned short count;
+    uint32_t pairs;
+    if (!readField(data, end, &count) || !readField(data, end, &pairs) || count > leaves.size()) {
+        return false;
+    }
+    for (uint32_t i = 0; i < pairs; i++) {
+        uint64_t key, version;
+        if (!readField(data, end, &key) || !readField(data, end, &version)) {
+            return false;
+        }
+        (*versions)[key] = version;
+    }
+    *answered = count;
+    return true;
+}
+
+// Compare our tree of a replica set with the one of a peer from the root down, following only the nodes that differ,
+// then send the peer the keys of the differing leaves it holds an older version of or misses
+// The peer does the same with us in its own rounds, so each side only ever pushes
+// Return the number of keys sent
+size_t syncReplicaSet(int set, int peerIdx) {
+    MerkleTree &tree = *merkleTrees[set];
+    vector<uint32_t> differing(1, 1);
+    for (int depth = 0; depth <= merkleDepth && !differing.empty(); depth++) {
+        vector<uint64_t> hashes;
+        if (!fetchMerkleNodes(peerIdx, set, differing, &hashes)) {
+            return 0;
+        }
+        vector<uint32_t> next;
+        for (size_t i = 0; i < differing.size(); i++) {
+            if (hashes[i] == tree.hash(differing[i])) {
+                continue;
+            }
+            if (depth == merkleDepth) {
+                next.push_back(differing[i] - merkleLeaves);
+            } else {
+                next.push_back(2 * differing[i]);
+                next.push_back(2 * differing[i] + 1);
+            }
+        }
+        differing.swap(next);
+    }
+    addCounter(COUNTER_ANTI_ENTROPY_LEAVES, differing.size());
+    size_t sent = 0;
+    size_t done = 0;
+    // Both sides answer from their live stores: a snapshot held across the round trips would keep every version
+    // replaced meanwhile, and a key changing under the walk is compared again next round
+    while (done < differing.size()) {
+        vector<uint32_t> leaves(differing.begin() + done,
+                                differing.begin() + min(differing.size(), done + merkleLeavesPerRequest));
+        unordered_map<uint64_t, uint64_t> versions;
+        size_t answered;
+        if (!fetchMerkleKeys(peerIdx, set, leaves, &answered, &versions) || answered == 0) {
+            break;
+        }
+        for (size_t i = 0; i < answered; i++) {
+            forEachLeafKey(set, leaves[i], storeLatest,
+                           [&](uint64_t key, const char *value, uint32_t length, uint64_t version) {
+                auto found = versions.find(key);
+                if (found != versions.end() && found->second >= version) {
+                    return;
+                }
+                // Sent like a replica write nobody waits for, kept as a hint if the peer fails meanwhile
+                ReplicaTask task;
+                task.peerIdx = peerIdx;
+                task.key = key;
+                task.value.assign(value, length);
+                task.version = version;
+                task.ticket = make_shared<WriteTicket>();
+                task.ticket->fired = true;
+                queueReplica(task);
+                sent++;
+            });
+        }
+        done += answered;
+    }
+    addCounter(COUNTER_ANTI_ENTROPY_KEYS, sent);
+    return sent;
+}
+
+// Anti-entropy thread: compares every replica set we hold with its other holders now and then, so a replica that
+// missed writes, even ones whose hints were dropped, is repaired with traffic in proportion to what it missed
+void antiEntropyThread() {
+    while (true) {
+        usleep(antiEntropyInterval * 1000);
+        for (int set = 0; set < ring.setCount(); set++) {
+            if (!merkleTrees[set]) {
+                continue;
+            }
+            const int *holders = ring.setHolders(set);
+            for (int i = 0; i < ring.replicaCount; i++) {
+                if (holders[i] == hostIndex || peerHealth.isDown(holders[i])) {
+                    continue;
+                }
+                size_t sent = syncReplicaSet(set, holders[i]);
+                if (sent > 0) {
+                    LOG_INFO("[AE] Sent %d keys of replica set %d to server %d", (int)sent, set, holders[i] + 1);
+                }
+            }
+        }
+    }
+}
+
+// Copies of a key a consistency level asks for, out of the replicaCount replicas
+int consistencyCopies(int consistency, bool write) {
+    switch (consistency) {
+        case CONSISTENCY_ONE:
+            return 1;
+        case CONSISTENCY_QUORUM:
+            return ring.replicaCount / 2 + 1;
+        case CONSISTENCY_ALL:
+            return ring.replicaCount;
+        default:
+            return write ? writeAcks + 1 : 1;
+    }
+}
+
+// A propigated write between sending it to the replicas and applying it locally
+struct PendingWrite {
+    uint64_t key;
+    string value;
+    uint64_t version;
+    shared_ptr<WriteTicket> ticket;
+    int replicas;
+};
+
+// Version a new write and queue it for every replica at once, it goes out with the next batch of each peer
+// ready runs once the replicas needed for copies copies answered, on a replication thread or right away if none is
+// needed
+PendingWrite propigateWrite(uint64_t key, const string &value, int copies, function<void()> ready) {
+    PendingWrite write;
+    write.key = key;
+    write.value = value;
+    write.version = hlcNow();
+    write.ticket = make_shared<WriteTicket>();
+    write.replicas = 0;
+    if (value.size() > maxValueLength) {
+        // Refused by completeWrite, never sent
+        ready();
+        return write;
+    }
+    LOG_DEBUG("[W] Writing %llu:%.*s:%d", (unsigned long long)key, printLength(value), value.data(), hashKey(key));
+    vector<int> peers;
+    const int *replicas = ring.replicas(key);
+    for (int i = 0; i < ring.replicaCount; i++) {
+        if (replicas[i] != hostIndex) {
+            peers.push_back(replicas[i]);
+        }
+    }
+    write.replicas = peers.size();
+    write.ticket->replicas = peers.size();
+    // Our own copy counts when we are one of the replicas
+    int ownCopy = ring.isReplica(key, hostIndex) ? 1 : 0;
+    write.ticket->requiredAcks = max(0, min(copies - ownCopy, write.replicas));
+    if (write.ticket->requiredAcks == 0) {
+        write.ticket->fired = true;
+        ready();
+    } else {
+        write.ticket->ready = ready;
+    }
+    for (size_t i = 0; i < peers.size(); i++) {
+        ReplicaTask task;
+        task.peerIdx = peers[i];
+        task.key = key;
+        task.value = value;
+        task.version = write.version;
+        task.ticket = write.ticket;
+        queueReplica(task);
+    }
+    return write;
+}
+
+// Sequence applyWrite returns for a write the store could not take
+const uint64_t writeFailed = UINT64_MAX;
+
+// Apply a write to the store and append it to the log
+// Return the log sequence to wait for before acknowledging it, 0 if the store already had a newer version,
+// writeFailed if it is out of memory
+uint64_t applyWrite(uint64_t key, const string &value, uint64_t version) {
+    hlcObserve(version);
+    switch (storePut(key, value.data(), value.size(), version)) {
+        case PUT_APPENDED:
+            LOG_DEBUG("[W] Appended key %llu:%.*s:%d", (unsigned long long)key, printLength(value), value.data(),
+                    hashKey(key));
+            break;
+        case PUT_UPDATED:
+            LOG_DEBUG("[W] Updated key %llu:%.*s:%d", (unsigned long long)key, printLength(value), value.data(),
+                    hashKey(key));
+            break;
+        case PUT_STALE:
+            LOG_DEBUG("[W] Ignored older version of key %llu:%.*s:%d", (unsigned long long)key, printLength(value),
+                    value.data(), hashKey(key));
+            return 0;
+        default:
+            LOG_ERROR("[W] Out of memory for key %llu", (unsigned long long)key);
+            return writeFailed;
+    }
+    vector<char> entry;
+    appendEntry(entry, key, value.data(), value.size(), version);
+    return walAppend(entry.data(), entry.size(), 1);
+}
+
+// Apply a propigated write once its ticket is ready, if enough replicas acked it
+// Return false if the write is refused or could not be stored, otherwise set walSequence to wait for before
+// acknowledging it
+bool completeWrite(const PendingWrite &write, uint64_t *walSequence) {
+    if (write.value.size() > maxValueLength) {
+        LOG_WARN("[W] Value of %d bytes is too large", (int)write.value.size());
+        return false;
+    }
+    int successPropigateCount;
+    {
+        lock_guard<mutex> lock(write.ticket->lock);
+        successPropigateCount = write.ticket->acks;
+    }
+    // if request was propigated to enough replicas, write is allowed
+    bool canMakeWrite = (successPropigateCount >= write.ticket->requiredAcks);
+    LOG_DEBUG("[RW] Propigated %d keys to %d servers, allow write: %d", successPropigateCount, write.replicas,
+            canMakeWrite);
+    if (!canMakeWrite) {
+        LOG_WARN("[W] Propigation failed, we are the only replica online, no write allowed");
+        return false;  // Propigation failed, we are the only replica online, no write allowed
+    }
+    // A coordinator outside the replica set keeps no copy, nothing would ever update or repair it
+    *walSequence = 0;
+    if (ring.isReplica(write.key, hostIndex)) {
+        *walSequence = applyWrite(write.key, write.value, write.version);
+    }
+    return *walSequence != writeFailed;
+}
+
+// Write key to store, on the shard owning the key, done(ok) runs on that shard once the write is answered
+// A propigated write gets a new version and waits for the replicas its consistency level asks for, a replicated one
+// keeps the version of the server that coordinated it
+void writeStore(uint64_t key, const string &value, bool propigate, uint64_t version, function<void(bool)> done,
+                int consistency = CONSISTENCY_DEFAULT) {
+    // The write is acknowledged only once it is in the log on disk
+    if (!propigate) {
+        // A replica that could not store it nacks it, the coordinator keeps it as a hint
+        uint64_t walSequence = applyWrite(key, value, version);
+        if (walSequence == writeFailed) {
+            done(false);
+            return;
+        }
+        afterDurable(walSequence, [done] { done(true); });
+        return;
+    }
+    // Wait for the replicas without holding the shard, the write comes back to it when they answered
+    shared_ptr<PendingWrite> write = make_shared<PendingWrite>();
+    int shard = currentShard;
+    *write = propigateWrite(key, value, consistencyCopies(consistency, true), [write, done, shard] {
+        postToShard(shard, [write, done] {
+            uint64_t walSequence = 0;
+            if (!completeWrite(*write, &walSequence)) {
+                done(false);
+                return;
+            }
+            afterDurable(walSequence, [done] { done(true); });
+        });
+    });
+}
+
+// Write key to store from a thread that is not a shard, waiting for the answer
+bool writeStore(uint64_t key, const string &value) {
+    promise<bool> result;
+    postToShard(shardOf(key), [&] { writeStore(key, value, true, 0, [&](bool ok) { result.set_value(ok); }); });
+    return result.get_future().get();
+}
+
+// A consistent read waiting for the replicas of its level: the newest copy answered wins, and once every replica
+// answered the ones holding an older copy, or none, are sent the newest
+struct ReadQuorum {
+    mutex lock;
+    int needed = 0;
+    int answers = 0;
+    int outstanding = 0;
+    bool fired = false;
+    bool found = false;
+    uint64_t version = 0;
+    string value;
+    // Version held by every replica that answered, 0 if it had no copy
+    vector<pair<int, uint64_t> > copies;
+    function<void(uint8_t, const string &)> ready;
+};
+
+// Ask a peer for its copy of a key
+// Return false if it did not answer, otherwise set found, and version and value if found
+bool fetchFromPeer(int peerIdx, uint64_t key, bool *found, uint64_t *version, string *value) {
+    vector<char> request;
+    size_t start = beginFrame(request, OP_FETCH, 0);
+    appendField(request, key);
+    endFrame(request, start);
+    vector<char> payload;
+    if (peerHealth.isDown(peerIdx) || !peerFrameRequest(peerIdx, request, &payload)) {
+        return false;
+    }
+    const char *data = payload.data();
+    const char *end = data + payload.size();
+    uint8_t present;
+    StoreEntry entry;
+    const char *bytes;
+    if (!readField(data, end, &present) || (present && !readEntry(data, end, &entry, &bytes))) {
+        return false;
+    }
+    *found = present;
+    if (present) {
+        *version = entry.version;
+        value->assign(bytes, entry.length);
+    }
+    return true;
+}
+
+// Send the newest copy of a key to the replicas that answered a read with an older one or none
+void repairReplicas(const ReadQuorum &quorum, uint64_t key) {
+    for (size_t i = 0; quorum.found && i < quorum.copies.size(); i++) {
+        if (quorum.copies[i].second >= quorum.version) {
+            continue;
+        }
+        addCounter(COUNTER_READ_REPAIRS);
+        LOG_DEBUG("[RR] Repairing key %llu on server %d", (unsigned long long)key, quorum.copies[i].first + 1);
+        if (quorum.copies[i].first == hostIndex) {
+            string value = quorum.value;
+            uint64_t version = quorum.version;
+            postToShard(shardOf(key), [=] { applyWrite(key, value, version); });
+            continue;
+        }
+        // Nobody waits for a repair, a failed one is kept as a hint like any replica write
+        ReplicaTask task;
+        task.peerIdx = quorum.copies[i].first;
+        task.key = key;
+        task.value = quorum.value;
+        task.version = quorum.version;
+        task.ticket = make_shared<WriteTicket>();
+        task.ticket->fired = true;
+        queueReplica(task);
+    }
+}
+
+// Record the answer of a replica to a read, answered tells if it answered at all
+void quorumAnswer(shared_ptr<ReadQuorum> quorum, uint64_t key, int server, bool answered, bool found, uint64_t version,
+                  const string &value) {
+    function<void(uint8_t, const string &)> ready;
+    uint8_t result = READ_UNAVAILABLE;
+    string newest;
+    bool finished;
+    {
+        lock_guard<mutex> lock(quorum->lock);
+        if (answered) {
+            quorum->answers++;
+            quorum->copies.push_back(make_pair(server, found ? version : 0));
+            if (found && (!quorum->found || version > quorum->version)) {
+                quorum->found = true;
+                quorum->version = version;
+                quorum->value = value;
+            }
+        }
+        finished = --quorum->outstanding == 0;
+        if (!quorum->fired && (quorum->answers >= quorum->needed || finished)) {
+            quorum->fired = true;
+            ready.swap(quorum->ready);
+            if (quorum->answers >= quorum->needed) {
+                result = quorum->found ? READ_FOUND : READ_MISSING;
+                newest = quorum->value;
+            }
+        }
+    }
+    if (ready) {
+        ready(result, newest);
+    }
+    if (finished) {
+        repairReplicas(*quorum, key);
+    }
+}
+
+// Read a key at a consistency level, on the shard owning it
+// ONE answers from our store right away when we are a replica, otherwise the replicas are asked at once and
+// done(found, value) runs on the peer thread of the answer completing the level
+void readReplicas(uint64_t key, int consistency, function<void(uint8_t, const string &)> done) {
+    string value;
+    uint64_t version = 0;
+    bool replica = ring.isReplica(key, hostIndex);
+    bool found = replica && readStore(key, &value, &version);
+    int copies = consistencyCopies(consistency, false);
+    if (copies <= 1 && replica) {
+        done(found ? READ_FOUND : READ_MISSING, value);
+        return;
+    }
+    shared_ptr<ReadQuorum> quorum = make_shared<ReadQuorum>();
+    quorum->needed = copies;
+    quorum->ready = done;
+    vector<int> peers;
+    const int *replicas = ring.replicas(key);
+    for (int i = 0; i < ring.replicaCount; i++) {
+        if (replicas[i] != hostIndex) {
+            peers.push_back(replicas[i]);
+        }
+    }
+    // Our own copy only counts if we are a replica
+    bool local = peers.size() < (size_t)ring.replicaCount;
+    quorum->outstanding = peers.size() + local;
+    if (local) {
+        quorumAnswer(quorum, key, hostIndex, true, found, version, value);
+    }
+    for (size_t i = 0; i < peers.size(); i++) {
+        int peerIdx = peers[i];
+        runOnPeerThread([=] {
+            bool peerFound = false;
+            uint64_t peerVersion = 0;
+            string peerValue;
+            bool answered = fetchFromPeer(peerIdx, key, &peerFound, &peerVersion, &peerValue);
+            quorumAnswer(quorum, key, peerIdx, answered, peerFound, peerVersion, peerValue);
+        });
+    }
+}
+
+// One key of a scan
+struct ScanEntry {
+    uint64_t key;
+    uint64_t version;
+    string value;
+};
+
+// Keys of a range in key order, from one store, one server or the whole cluster
+struct ScanPart {
+    vector<ScanEntry> entries;
+    // Stopped at a limit, keys after the last entry may be missing
+    bool truncated = false;
+};
+
+// Merge parts holding distinct keys into the first limit keys of their union, up to maxBytes of entries
+// Past the last entry of a truncated part nothing is known, the merge stops at the first such end
+ScanPart mergeScanParts(vector<ScanPart> &parts, size_t limit, size_t maxBytes) {
+    ScanPart merged;
+    uint64_t known = UINT64_MAX;
+    for (size_t i = 0; i < parts.size(); i++) {
+        if (parts[i].truncated && !parts[i].entries.empty()) {
+            known = min(known, parts[i].entries.back().key);
+        }
+        merged.truncated |= parts[i].truncated;
+        move(parts[i].entries.begin(), parts[i].entries.end(), back_inserter(merged.entries));
+    }
+    sort(merged.entries.begin(), merged.entries.end(),
+         [](const ScanEntry &a, const ScanEntry &b) { return a.key < b.key; });
+    size_t bytes = 0;
+    size_t kept = 0;
+    for (; kept < merged.entries.size(); kept++) {
+        size_t entryBytes = sizeof(StoreEntry) + merged.entries[kept].value.size();
+        if (merged.entries[kept].key > known || kept == limit || (kept > 0 && bytes + entryBytes > maxBytes)) {
+            merged.truncated = true;
+            break;
+        }
+        bytes += entryBytes;
+    }
+    merged.entries.resize(kept);
+    return merged;
+}
+
+// Scan our stores for the keys from start to end of the replica sets flagged in sets
+ScanPart scanLocal(uint64_t start, uint64_t end, size_t limit, const vector<bool> &sets) {
+    vector<ScanPart> parts(shards.size());
+    for (size_t i = 0; i < shards.size(); i++) {
+        ScanPart &part = parts[i];
+        size_t bytes = 0;
+        part.truncated = !shards[i]->store.scan(start, end, [&](uint64_t key, const char *value, uint32_t length,
+                                                                uint64_t version) {
+            if (!sets[ring.replicaSetOf(key)]) {
+                return true;
+            }
+            if (part.entries.size() == limit || (bytes > 0 && bytes + sizeof(StoreEntry) + length > scanMaxBytes)) {
+                return false;
+            }
+            ScanEntry entry = {key, version, string(value, length)};
+            part.entries.push_back(entry);
+            bytes += sizeof(StoreEntry) + length;
+            return true;
+        });
+    }
+    return mergeScanParts(parts, limit, scanMaxBytes);
+}
+
+void appendScanEntries(vector<char> &out, const ScanPart &part) {
+    appendField<unsigned short>(out, part.entries.size());
+    for (size_t i = 0; i < part.entries.size(); i++) {
+        const ScanEntry &entry = part.entries[i];
+        appendEntry(out, entry.key, entry.value.data(), entry.value.size(), entry.version);
+    }
+}
+
+// Ask a peer for the keys from start to end it holds of some replica sets
+bool fetchScan(int peerIdx, uint64_t start, uint64_t end, unsigned short limit, const vector<uint16_t> &sets,
+               ScanPart *part) {
+    vector<char> request;
+    size_t frame = beginFrame(request, OP_SCAN_LOCAL, 0);
+    appendField(request, start);
+    appendField(request, end);
+    appendField(request, limit);
+    appendField<unsigned short>(request, sets.size());
+    for (size_t i = 0; i < sets.size(); i++) {
+        appendField(request, sets[i]);
+    }
+    endFrame(request, frame);
+    vector<char> payload;
+    if (!peerFrameRequest(peerIdx, request, &payload)) {
+        return false;
+    }
+    const char *data = payload.data();
+    const char *dataEnd = data + payload.size();
+    uint8_t more;
+    unsigned short count;
+    if (!readField(data, dataEnd, &more) || !readField(data, dataEnd, &count)) {
+        return false;
+    }
+    part->truncated = more;
+    part->entries.resize(count);
+    for (int i = 0; i < count; i++) {
+        StoreEntry entry;
+        const char *value;
+        if (!readEntry(data, dataEnd, &entry, &value)) {
+            return false;
+        }
+        part->entries[i].key = entry.key;
+        part->entries[i].version = entry.version;
+        part->entries[i].value.assign(value, entry.length);
+    }
+    return true;
+}
+
+// Scan the keys from start to end of the whole cluster, on a peer thread
+// Every replica set is read from one holder, ourselves if we are one, another holder if that one fails, and the
+// parts of the servers asked are merged into one page
+// Return false if a replica set has no live holder left
+bool scanCluster(uint64_t start, uint64_t end, unsigned short limit, ScanPart *page) {
+    int setCount = ring.setCount();
+    vector<bool> failed(cluster.hosts.size(), false);
+    vector<uint16_t> pending;
+    for (int set = 0; set < setCount; set++) {
+        pending.push_back(set);
+    }
+    vector<ScanPart> parts;
+    while (!pending.empty()) {
+        vector<vector<uint16_t> > asked(cluster.hosts.size());
+        for (size_t i = 0; i < pending.size(); i++) {
+            const int *holders = ring.setHolders(pending[i]);
+            int chosen = -1;
+            for (int j = 0; j < ring.replicaCount; j++) {
+                int host = holders[j];
+                if (failed[host] || (host != hostIndex && peerHealth.isDown(host))) {
+                    continue;
+                }
+                if (chosen < 0 || host == hostIndex) {
+                    chosen = host;
+                }
+            }
+            if (chosen < 0) {
+                return false;
+            }
+            asked[chosen].push_back(pending[i]);
+        }
+        pending.clear();
+        for (int host = 0; host < (int)asked.size(); host++) {
+            if (asked[host].empty()) {
+                continue;
+            }
+            ScanPart part;
+            if (host == hostIndex) {
+                vector<bool> sets(setCount, false);
+                for (size_t i = 0; i < asked[host].size(); i++) {
+                    sets[asked[host][i]] = true;
+                }
+                part = scanLocal(start, end, limit, sets);
+            } else if (!fetchScan(host, start, end, limit, asked[host], &part)) {
+                failed[host] = true;
+                pending.insert(pending.end(), asked[host].begin(), asked[host].end());
+                continue;
+            }
+            parts.push_back(move(part));
         }
     }
-    return 0;
+    *page = mergeScanParts(parts, limit, scanMaxBytes);
+    return true;
 }
 
-int hashKey(unsigned short int key) { return ((key + 7) % 7); }
+void serveConnection(Connection *conn);
+void closeConnection(Connection *conn);
+void rearmConnection(Connection *conn);
 
-bool isKeyRelatedToHost(unsigned short int key, int recoverHostIndex) {
-    int hash = hashKey(key);
-    // We only save keys in the same server, copy it to the next 2 servers only
-    for (int i = -2; i <= 0; i++) {
-        if (hash == (recoverHostIndex + i + 7) % 7) {
-            return true;
+// Send length bytes of a file from offset as one RECOVER_SEGMENT, the kernel moves them from the page cache
+// Return false if the connection failed
+bool sendSegment(int socket, int file, off_t offset, uint64_t length) {
+    unsigned short int header[3] = {RECOVER_SEGMENT, 0, 0};
+    if (!sendAll(socket, header, sizeof(header)) || !sendAll(socket, &length, sizeof(length))) {
+        return false;
+    }
+    while (length > 0) {
+        ssize_t sent = sendfile(socket, file, &offset, length);
+        if (sent < 0 && errno == EINTR) {
+            continue;
         }
+        if (sent <= 0) {
+            return false;
+        }
+        length -= sent;
     }
-    return false;
+    return true;
 }
 
-// Write key to store
-bool writeStore(unsigned short int key, unsigned short int value, bool propigate = true) {
-    // Propigate the request to the next servers
-    bool canMakeWrite = !propigate;
-    if (propigate) {
-        short int propigateNextCount = 2;
-        short int successPropigateCount = 0;
-        printf("[W] Writing %d:%d:%d\n", key, value, hashKey(key));
-
-        int peerIdx;
-        for (int i = 0; i <= 2; i++) {
-            peerIdx = (hashKey(key) + i + 7) % 7;
-            if (peerIdx == hostIndex) {
-                continue;
+// Stream to a recovering host the related keys newer than its high-water mark of their range
+// Nothing is read from the store: for every range the host keeps a copy of we send the tail of the range in the
+// snapshot newer than its mark, then the logs written since the snapshot, with sendfile. The host drops the keys
+// that are not its own, so helping it costs us a few syscalls and no copy in user space
+void recoverHost(unsigned short int recoverHostIndex, vector<uint64_t> since, Connection *conn) {
+    LOG_INFO("[RH] Help Recovering host %d", recoverHostIndex);
+    // Open every file first, an open file stays readable after a newer snapshot replaces it or drops it
+    SnapshotHeader header;
+    int snapshot;
+    vector<int> logs;
+    vector<uint64_t> logLengths;
+    {
+        lock_guard<mutex> lock(snapshotFilesMutex);
+        snapshot = open(snapshotPath().c_str(), O_RDONLY);
+        if (snapshot >= 0 &&
+            (pread(snapshot, &header, sizeof(header), 0) != sizeof(header) || memcmp(header.magic, "KVS3", 4) != 0)) {
+            close(snapshot);
+            snapshot = -1;
+        }
+        lock_guard<mutex> fileLock(walFileMutex);
+        for (uint32_t generation = snapshot >= 0 ? header.generation : 0; generation <= walGeneration; generation++) {
+            int log = open(walPath(generation).c_str(), O_RDONLY);
+            struct stat info;
+            // The log being written is sent up to its last complete batch
+            if (log >= 0 && fstat(generation == walGeneration ? walFile : log, &info) == 0) {
+                logs.push_back(log);
+                logLengths.push_back(info.st_size);
+            } else if (log >= 0) {
+                close(log);
             }
-            char *peer = hosts[peerIdx];
-
-            printf("[RW] Propigate to %s\n", peer);
+        }
+    }
 
-            /**
-             * Open connection and send replica write to the peer
-             *
-             */
-            int peerSocket = socket(AF_INET, SOCK_STREAM, 0);
-            if (peerSocket < 0) {
-                cout << "[RW] Error at socket(): " << strerror(errno) << endl;
-                continue;
-            }
-            sockaddr_in service;  // initialising service as sockaddr_in structure
-            service.sin_family = AF_INET;
-            service.sin_addr.s_addr = inet_addr(peer);
-            service.sin_port = htons(port);
-            if (connect(peerSocket, (struct sockaddr *)&service, sizeof(service)) < 0) {
-                // Error connecting to server
-                printf("[RW] Error connecting to server: %s\n", strerror(errno));
-                close(peerSocket);
-                continue;
+    bool failed = false;
+    uint64_t sentBytes = 0;
+    if (snapshot >= 0) {
+        vector<SnapshotRange> table(header.ranges);
+        vector<SnapshotMark> marks(header.marks);
+        ssize_t tableLength = table.size() * sizeof(SnapshotRange);
+        ssize_t marksLength = marks.size() * sizeof(SnapshotMark);
+        if (pread(snapshot, table.data(), tableLength, sizeof(header)) != tableLength ||
+            pread(snapshot, marks.data(), marksLength, sizeof(header) + tableLength) != marksLength) {
+            table.clear();
+        }
+        // Ranges of a snapshot taken with another cluster layout do not match ours, they are sent whole
+        bool sameLayout = table.size() == cluster.hosts.size();
+        vector<bool> held = ring.rangesHeldBy(recoverHostIndex);
+        for (size_t range = 0; range < table.size() && !failed; range++) {
+            uint64_t offset = table[range].offset;
+            uint64_t end = offset + table[range].length;
+            if (sameLayout) {
+                if (!held[range]) {
+                    continue;
+                }
+                // Start at the last mark the host already has, every entry before it is older
+                SnapshotMark *first = marks.data() + table[range].firstMark;
+                SnapshotMark *last = first + table[range].markCount;
+                SnapshotMark *next = upper_bound(first, last, since[range],
+                                                 [](uint64_t version, const SnapshotMark &mark) {
+                                                     return version < mark.version;
+                                                 });
+                if (next != first) {
+                    offset = (next - 1)->offset;
+                }
             }
-            unsigned short int message[3];
-            message[0] = REPLICATE_WRITE;  // Recovery Request
-            message[1] = key;
-            message[2] = value;
-            send(peerSocket, message, sizeof(message), 0);
-            int rbyteCount = recv(peerSocket, message, sizeof(message), 0);
-            if (rbyteCount < 0) {
-                cout << "[RW] Server recv error: " << strerror(errno) << endl;
-            } else if (rbyteCount == 0) {
-                // Connection closed
-                cout << "[RW] Server recv error: " << strerror(errno) << endl;
-            } else {
-                successPropigateCount++;
-                printf("[RW] Successful propigation\n");
+            if (end > offset) {
+                failed = !sendSegment(conn->socket, snapshot, offset, end - offset);
+                sentBytes += end - offset;
             }
-            close(peerSocket);
         }
-        // if request was propigated at least once, write is allowed
-        canMakeWrite = (successPropigateCount >= 1);
-        printf("[RW] Propigated %d keys to %d servers, allow write: %d\n", successPropigateCount, propigateNextCount,
-               canMakeWrite);
+        close(snapshot);
     }
-
-    if (!canMakeWrite) {
-        printf("[W] Propigation failed, we are the only replica online, no write allowed\n");
-        return false;  // Propigation failed, we are the only replica online, no write allowed
+    // Logs are not sorted, every record written since the snapshot is sent
+    for (size_t i = 0; i < logs.size(); i++) {
+        if (!failed && logLengths[i] > 0) {
+            failed = !sendSegment(conn->socket, logs[i], 0, logLengths[i]);
+            sentBytes += logLengths[i];
+        }
+        close(logs[i]);
     }
+    if (failed) {
+        LOG_WARN("[RH] Send error: %s", strerror(errno));
+        postToShard(conn->shard, [conn] { closeConnection(conn); });
+        return;
+    }
+    // Mark the end of the stream, the connection stays open for the next request
+    unsigned short int message[3] = {RECOVER_END, 0, 0};
+    sendAll(conn->socket, message, sizeof(message));
+    setBlocking(conn->socket, false);
+    postToShard(conn->shard, [conn] { serveConnection(conn); });
+    addCounter(COUNTER_RECOVERY_SENT, sentBytes);
+    LOG_INFO("[RH] Sent %llu bytes to %d", (unsigned long long)sentBytes, recoverHostIndex);
+}
 
-    for (int i = 0; i < storeIndex; i++) {
-        if (store[i][0] == key) {
-            // Key already exists, update value
-            store[i][1] = value;
-            printf("[W] Updated key %d:%d:%d\n", key, value, hashKey(key));
-            return true;
+// Move one segment of length bytes from a socket to a file at offset through a pipe, the bytes never reach user
+// space
+// Return false if the connection or the file failed
+bool receiveSegment(int socket, int pipeFds[2], int file, loff_t *offset, uint64_t length) {
+    while (length > 0) {
+        ssize_t moved = splice(socket, NULL, pipeFds[1], NULL, min<uint64_t>(length, recoverSpliceSize), SPLICE_F_MOVE);
+        if (moved < 0 && errno == EINTR) {
+            continue;
+        }
+        if (moved <= 0) {
+            return false;
+        }
+        length -= moved;
+        while (moved > 0) {
+            ssize_t written = splice(pipeFds[0], NULL, file, offset, moved, SPLICE_F_MOVE);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                return false;
+            }
+            moved -= written;
         }
     }
-
-    // Key doesnt exist, append it to our keyStore
-    storeMutex.lock();
-    store[storeIndex] = {key, value};
-    storeIndex++;
-    storeMutex.unlock();
-    printf("[W] Appended key %d:%d:%d\n", key, value, hashKey(key));
     return true;
 }
 
-void recoverHost(unsigned short int recoverHostIndex, int peerSocket) {
-    printf("[RH] Help Recovering host %d\n", recoverHostIndex);
-    // Send all store values to host
+// Pull from one peer every related key newer than our marks at startup, its segments are appended to file and
+// received is set to their length
+void recoverFromPeer(int peerIdx, int file, uint64_t *received) {
+    // Peer IP address
+    const char *peer = cluster.hosts[peerIdx].c_str();
+    int pipeFds[2];
+    if (pipe(pipeFds) < 0) {
+        LOG_ERROR("[R] Error at pipe(): %s", strerror(errno));
+        return;
+    }
+    fcntl(pipeFds[1], F_SETPIPE_SZ, recoverSpliceSize);
+    int peerSocket = peerHealth.isDown(peerIdx) ? -1 : acquirePeer(peerIdx);
+    if (peerSocket < 0) {
+        LOG_WARN("[R] Failed to connect to server: %s", peer);
+        close(pipeFds[0]);
+        close(pipeFds[1]);
+        return;
+    }
+    setSocketDeadline(peerSocket, recoverTimeout);
+    // {RECOVER_REQUEST, hostIndex, ranges} followed by what we already have of each range
+    int ranges = cluster.hosts.size();
+    vector<char> request(3 * sizeof(unsigned short int) + ranges * sizeof(uint64_t));
     unsigned short int message[3];
-    int keycount = 0;
-    for (int i = 0; i < storeIndex; i++) {
-        if (isKeyRelatedToHost(store[i][0], recoverHostIndex)) {
-            // printf("[RH] Sending key %d to %d\n", store[i][0], recoverHostIndex);
-            // We only send keys that is related to the host only
-            message[0] = RECOVER_WRITE;  // Recover write
-            message[1] = store[i][0];
-            message[2] = store[i][1];
-            send(peerSocket, message, sizeof(message), 0);
-            keycount++;
+    message[0] = RECOVER_REQUEST;  // Recovery Request
+    message[1] = hostIndex;
+    message[2] = ranges;
+    memcpy(request.data(), message, sizeof(message));
+    for (int range = 0; range < ranges; range++) {
+        uint64_t since = recoverySince[range];
+        memcpy(request.data() + sizeof(message) + range * sizeof(uint64_t), &since, sizeof(since));
+    }
+    bool complete = false;
+    loff_t offset = 0;
+    bool sent = sendAll(peerSocket, request.data(), request.size());
+    if (!sent) {
+        LOG_WARN("[R] Send error to %s: %s", peer, strerror(errno));
+    }
+    while (sent) {
+        uint64_t length;
+        if (recv(peerSocket, message, sizeof(message), MSG_WAITALL) != sizeof(message)) {
+            LOG_WARN("[R] Server recv error from %s: %s", peer, strerror(errno));
+            break;
+        }
+        if (message[0] == RECOVER_END) {
+            complete = true;
+            break;
+        }
+        if (message[0] != RECOVER_SEGMENT) {
+            LOG_WARN("[R] Unexpected message from %s", peer);
+            break;
+        }
+        if (recv(peerSocket, &length, sizeof(length), MSG_WAITALL) != sizeof(length) ||
+            !receiveSegment(peerSocket, pipeFds, file, &offset, length)) {
+            LOG_WARN("[R] Server recv error from %s: %s", peer, strerror(errno));
+            break;
         }
+        *received = offset;
     }
-    close(peerSocket);
-    printf("[RH] Sent %d keys to %d\n", keycount, recoverHostIndex);
+    close(pipeFds[0]);
+    close(pipeFds[1]);
+    if (complete) {
+        setSocketDeadline(peerSocket, peerRequestTimeout);
+        releasePeer(peerIdx, peerSocket);
+    } else {
+        close(peerSocket);
+    }
+    LOG_INFO("[R] Received %llu bytes from %s", (unsigned long long)*received, peer);
 }
 
-// Recover our keys if any from nearby servers
+// Recover our keys if any from nearby servers, only what changed since our marks at startup is transferred
 void recoverKeys() {
+    auto started = chrono::steady_clock::now();
+    // Pull at the same time from every server we share a replica set with to get all related keys
+    // Segments land in memory files and are mapped once complete
+    vector<int> peers = ring.neighbours(hostIndex);
+    vector<int> files(peers.size());
+    vector<uint64_t> received(peers.size(), 0);
+    vector<thread> pulls;
+    for (size_t i = 0; i < peers.size(); i++) {
+        files[i] = memfd_create("recovery", 0);
+        if (files[i] < 0) {
+            LOG_ERROR("[R] Error at memfd_create(): %s", strerror(errno));
+            continue;
+        }
+        pulls.push_back(thread(recoverFromPeer, peers[i], files[i], &received[i]));
+    }
+    for (size_t i = 0; i < pulls.size(); i++) {
+        pulls[i].join();
+    }
+
+    // Merge every segment into the store in one pass, the newest version of a key wins whichever peer sent it
+    // Peers send whole ranges and logs, the keys we do not keep a copy of are dropped here
+    vector<char> recovered;
     int recoveredKeys = 0;
-    // Connect to 2 servers back and 2 server forward to get all related keys
-    for (int i = -2; i <= 2; i++) {
-        if (i == 0) {
-            // Skip our own server
+    size_t receivedBytes = 0;
+    for (size_t i = 0; i < files.size(); i++) {
+        void *data = received[i] > 0 ? mmap(NULL, received[i], PROT_READ, MAP_PRIVATE, files[i], 0) : MAP_FAILED;
+        if (data != MAP_FAILED) {
+            madvise(data, received[i], MADV_SEQUENTIAL);
+            const char *entries = (const char *)data;
+            const char *end = entries + received[i];
+            StoreEntry entry;
+            const char *value;
+            while (readEntry(entries, end, &entry, &value)) {
+                hlcObserve(entry.version);
+                if (!isKeyRelatedToHost(entry.key, hostIndex)) {
+                    continue;
+                }
+                int result = storePut(entry.key, value, entry.length, entry.version);
+                if (result == PUT_APPENDED || result == PUT_UPDATED) {
+                    appendEntry(recovered, entry.key, value, entry.length, entry.version);
+                    recoveredKeys++;
+                }
+            }
+            munmap(data, received[i]);
+        }
+        if (files[i] >= 0) {
+            close(files[i]);
+        }
+        receivedBytes += received[i];
+    }
+    walWait(walAppend(recovered.data(), recovered.size(), recoveredKeys));
+    addCounter(COUNTER_RECOVERED_KEYS, recoveredKeys);
+    addCounter(COUNTER_RECOVERED_BYTES, receivedBytes);
+    addCounter(COUNTER_RECOVERY_NANOS,
+               chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - started).count());
+    long elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - started).count();
+    LOG_INFO("[R] Recovered %d keys from %d servers in %ld ms", recoveredKeys, (int)peers.size(), elapsed);
+}
+
+// Text dump of every metric, merged over all threads
+string metricsReport() {
+    static const char *names[] = {"read", "write", "replicate_write", "mget", "mset", "scan"};
+    vector<LatencyHistogram> histograms(metricCount);
+    uint64_t counters[counterCount];
+    mergeMetrics(histograms.data(), counters);
+    ostringstream report;
+    char line[256];
+    auto printHistogram = [&](const string &name, const LatencyHistogram &histogram) {
+        snprintf(line, sizeof(line), "%-28s count=%llu mean=%.1fus p50=%.1fus p99=%.1fus p999=%.1fus max=%.1fus\n",
+                 name.c_str(), (unsigned long long)histogram.total.load(), histogram.mean() / 1000,
+                 histogram.percentile(50) / 1000.0, histogram.percentile(99) / 1000.0,
+                 histogram.percentile(99.9) / 1000.0, histogram.maximum.load() / 1000.0);
+        report << line;
+    };
+    for (int i = 0; i < METRIC_PROPAGATE; i++) {
+        printHistogram(names[i], histograms[i]);
+    }
+    for (int peerIdx = 0; peerIdx < (int)cluster.hosts.size(); peerIdx++) {
+        if (peerIdx == hostIndex) {
             continue;
         }
-        int peerSocket = socket(AF_INET, SOCK_STREAM, 0);
-        if (peerSocket < 0) {
-            cout << "[R] Error at socket(): " << strerror(errno) << endl;
-            return;
+        printHistogram("propagate " + cluster.hosts[peerIdx] + ":" + to_string(cluster.ports[peerIdx]),
+                       histograms[METRIC_PROPAGATE + peerIdx]);
+        if (peerHealth.isDown(peerIdx)) {
+            report << "down " << cluster.hosts[peerIdx] << ":" << cluster.ports[peerIdx] << "\n";
         }
-        // Peer IP address
-        char *peer = hosts[(hostIndex + i + 7) % 7];
-        printf("[R] Recovering from %s\n", peer);
-        sockaddr_in service;  // initialising service as sockaddr_in structure
-        service.sin_family = AF_INET;
-        service.sin_addr.s_addr = inet_addr(peer);
-        service.sin_port = htons(port);
-        int retry = 0;
-        int maxRetry = 1;
-        while (retry < maxRetry) {
-            if (connect(peerSocket, (struct sockaddr *)&service, sizeof(service)) < 0) {
-                // cout << "[R] connect(): Error connecting to server: " << strerror(errno) << endl;
-                // close(peerSocket);
-                retry++;
-                usleep(2 * 1000000);  // 2 seconds sleep
+        if (counters[COUNTER_PROPAGATE_ERRORS + peerIdx]) {
+            report << "propagate errors " << cluster.hosts[peerIdx] << " " << counters[COUNTER_PROPAGATE_ERRORS + peerIdx]
+                   << "\n";
+        }
+    }
+    double recoverySeconds = counters[COUNTER_RECOVERY_NANOS] / 1e9;
+    snprintf(line, sizeof(line), "recovery received=%llu keys %llu bytes in %.3fs (%.0f keys/s), sent=%llu bytes\n",
+             (unsigned long long)counters[COUNTER_RECOVERED_KEYS], (unsigned long long)counters[COUNTER_RECOVERED_BYTES],
+             recoverySeconds, recoverySeconds > 0 ? counters[COUNTER_RECOVERED_KEYS] / recoverySeconds : 0,
+             (unsigned long long)counters[COUNTER_RECOVERY_SENT]);
+    report << line;
+    snprintf(line, sizeof(line), "hints queued=%llu replayed=%llu dropped=%llu\n",
+             (unsigned long long)counters[COUNTER_HINTS_QUEUED], (unsigned long long)counters[COUNTER_HINTS_REPLAYED],
+             (unsigned long long)counters[COUNTER_HINTS_DROPPED]);
+    report << line;
+    report << "read repairs=" << counters[COUNTER_READ_REPAIRS] << " anti-entropy leaves=" <<
+        counters[COUNTER_ANTI_ENTROPY_LEAVES] << " keys sent=" << counters[COUNTER_ANTI_ENTROPY_KEYS] << "\n";
+    uint64_t batches = counters[COUNTER_REPLICATION_BATCHES];
+    snprintf(line, sizeof(line), "replication batches=%llu writes=%llu (%.1f per batch) coalesced=%llu\n",
+             (unsigned long long)batches, (unsigned long long)counters[COUNTER_REPLICATION_WRITES],
+             batches ? (double)counters[COUNTER_REPLICATION_WRITES] / batches : 0.0,
+             (unsigned long long)counters[COUNTER_REPLICATION_COALESCED]);
+    report << line;
+    report << "connections accepted=" << counters[COUNTER_ACCEPTED] << " store size=" << storeCount() << " shards="
+           << shardCount << "\n";
+    vector<SlabAllocator *> slabs;
+    size_t keptVersions = 0;
+    for (size_t i = 0; i < shards.size(); i++) {
+        slabs.push_back(&shards[i]->store.slabs);
+        keptVersions += shards[i]->store.historyVersions;
+    }
+    report << "snapshots open=" << storeEpochs().open << " versions kept for them=" << keptVersions << "\n";
+    report << "log records written=" << logRegistry().written << " dropped=" << logDropped()
+           << " suppressed=" << logRegistry().suppressed << "\n";
+    report << slabReport(slabs);
+    return report.str();
+}
+
+// Length of the message at the start of a connection buffer
+// Return 0 if more bytes are needed to know it or to complete the message, -1 if the message is invalid
+long messageLength(const char *data, size_t available) {
+    if (isFrame(data, available)) {
+        FrameHeader header;
+        if (available < sizeof(header)) {
+            return 0;
+        }
+        memcpy(&header, data, sizeof(header));
+        if (header.version != FRAME_VERSION || header.length > maxFramePayload) {
+            return -1;
+        }
+        long length = sizeof(header) + header.length;
+        return (long)available >= length ? length : 0;
+    }
+    // The header comes first, its type tells how long the trailer is
+    unsigned short int incoming[3];
+    if (available < sizeof(incoming)) {
+        return 0;
+    }
+    memcpy(incoming, data, sizeof(incoming));
+    int trailer = trailerLength(incoming);
+    if (trailer < 0) {
+        return -1;
+    }
+    long length = sizeof(incoming) + trailer;
+    return (long)available >= length ? length : 0;
+}
+
+// Send what the socket of a connection takes of its waiting replies, without blocking
+// Return false if the connection failed
+bool flushConnection(Connection *conn) {
+    while (conn->outSent < conn->out.size()) {
+        ssize_t sent = send(conn->socket, conn->out.data() + conn->outSent, conn->out.size() - conn->outSent,
+                            MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
                 continue;
-            } else {
-                break;
             }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
         }
-        if (retry >= maxRetry) {
-            cout << "[R] Failed to connect to server: " << peer << " - " << strerror(errno) << endl;
-            close(peerSocket);
-            continue;
+        conn->outSent += sent;
+    }
+    conn->out.clear();
+    conn->outSent = 0;
+    return true;
+}
+
+// Queue a reply on a connection, on its shard, and send what the socket takes now
+// The rest goes out when epoll reports the socket writable
+void sendReply(Connection *conn, const vector<char> &reply) {
+    conn->out.insert(conn->out.end(), reply.begin(), reply.end());
+    if (!flushConnection(conn)) {
+        // The event loop sees the connection fail and closes it
+        shutdown(conn->socket, SHUT_RDWR);
+    } else if (!conn->out.empty() && !conn->serving) {
+        rearmConnection(conn);
+    }
+}
+
+// Answer a request on the shard of its connection, unless the client went away meanwhile
+void finishRequest(Connection *conn, const vector<char> &reply, int metric, chrono::steady_clock::time_point started) {
+    conn->pending--;
+    if (conn->socket < 0) {
+        if (conn->pending == 0) {
+            delete conn;
         }
-        // cout << "[R] Connected to server: " << peer << endl;
-        unsigned short int message[3];
-        message[0] = RECOVER_REQUEST;  // Recovery Request
-        message[1] = hostIndex;
-        message[2] = 0;
-        send(peerSocket, message, sizeof(message), 0);
-        while (true) {
-            int rbyteCount = recv(peerSocket, message, sizeof(message), 0);
-            // printf("[R] recv rbyteCount %d\n", rbyteCount);
-            if (rbyteCount < 0) {
-                cout << "[R] Server recv error: " << strerror(errno) << endl;
-                break;
-            } else if (rbyteCount == 0) {
-                // Connection closed
-                // cout << "[R] Server recv error: " << strerror(errno) << endl;
-                break;
-            } else {
-                // printf("[R] Recovering from %s, %d,%d,%d\n", peer, message[0], message[1], message[2]);
-                writeStore(message[1], message[2], false);
-                recoveredKeys++;
+        return;
+    }
+    sendReply(conn, reply);
+    if (metric >= 0) {
+        recordLatency(metric, started);
+    }
+}
+
+// Send a reply built on any shard back to the shard of the connection
+void answerRequest(Connection *conn, int origin, const vector<char> &reply, int metric,
+                   chrono::steady_clock::time_point started) {
+    runOnShard(origin, [=] { finishRequest(conn, reply, metric, started); });
+}
+
+// Process one complete legacy message received on a connection
+// Return false if the connection was handed over to another thread
+bool handleMessage(Connection *conn, const char *message) {
+    unsigned short int incoming[3];
+    memcpy(incoming, message, sizeof(incoming));
+    const char *trailer = message + sizeof(incoming);
+    unsigned short int key = incoming[1];
+    unsigned short int value = incoming[2];
+    int origin = conn->shard;
+    auto started = chrono::steady_clock::now();
+    // Process message here
+    LOG_DEBUG("[S] Server recv %d, %d, %d", incoming[0], incoming[1], incoming[2]);
+    switch (incoming[0]) {
+        case READ_REQUEST:  // Read
+            conn->pending++;
+            // Read like an OP_GET at ONE, a server outside the replica set of the key asks the replicas
+            runOnShard(shardOf(key), [=] {
+                readReplicas(key, CONSISTENCY_ONE, [=](uint8_t found, const string &value) {
+                    unsigned short int reply = legacyValue(found, value);
+                    answerRequest(conn, origin, vector<char>((char *)&reply, (char *)&reply + sizeof(reply)),
+                                  METRIC_READ, started);
+                });
+            });
+            break;
+        case WRITE_REQUEST:  // Write
+            conn->pending++;
+            runOnShard(shardOf(key), [=] {
+                writeStore(key, to_string(value), true, 0, [=](bool ok) {
+                    unsigned short int didWrite = ok;
+                    answerRequest(conn, origin, vector<char>((char *)&didWrite, (char *)&didWrite + sizeof(didWrite)),
+                                  METRIC_WRITE, started);
+                });
+            });
+            break;
+        case RECOVER_REQUEST: {  // Recovery Request
+            // message = {r, hostIndex, ranges} + since version of each range, ranges we were not told about start at 0
+            vector<uint64_t> since(cluster.hosts.size(), 0);
+            memcpy(since.data(), trailer, min((size_t)incoming[2], since.size()) * sizeof(uint64_t));
+            // The stream would interleave with the replies still owed on the connection, a recovering host sends
+            // its request first on a connection of its own
+            if (conn->pending > 0 || !conn->out.empty()) {
+                LOG_WARN("[RH] Recovery request behind requests in flight, closing connection");
+                closeConnection(conn);
+                return false;
             }
+            // Nothing else is sent before the recovery request is answered, the thread owns the connection now
+            // It streams with blocking calls, a host that stops reading fails the stream at the deadline
+            conn->buffer.clear();
+            setBlocking(conn->socket, true);
+            setSocketDeadline(conn->socket, recoverTimeout);
+            thread(recoverHost, incoming[1], since, conn).detach();
+            return false;  // The recovery thread gives the connection back once the stream is sent
         }
-        close(peerSocket);
-        printf("[R] Recovered %d keys from %s\n", recoveredKeys, peer);
+        default:
+            LOG_WARN("Invalid message type");
     }
+    return true;
 }
 
-// Socket server initialized
-void socketServer() {
-    serverSocket = socket(AF_INET, SOCK_STREAM, 0);
-    if (serverSocket < 0) {
-        cout << "Error at socket(): " << strerror(errno) << endl;
-        return;
+// Answers of an MGET or MSET, gathered on the shard of the connection as the shards owning the keys reply
+struct MultiRequest {
+    vector<uint8_t> found;
+    vector<string> values;
+    int remaining;
+};
+
+// Process one complete frame, its reply is tagged with the request id so the client can pipeline requests
+// A key owned by another shard is sent to it, the reply comes back here once that shard answered
+// Return false if the frame is malformed and the connection should be closed
+bool handleFrame(Connection *conn, const char *frame) {
+    FrameHeader header;
+    memcpy(&header, frame, sizeof(header));
+    const char *data = frame + sizeof(header);
+    const char *end = data + header.length;
+    vector<char> reply;
+    size_t start = beginFrame(reply, header.op | OP_REPLY, header.requestId);
+    uint64_t key;
+    const char *bytes;
+    uint32_t length;
+    unsigned short int count;
+    int origin = conn->shard;
+    auto started = chrono::steady_clock::now();
+    uint8_t op = header.op & OP_MASK;
+    int consistency = frameConsistency(header.op);
+    switch (op) {
+        case OP_GET:
+            if (!readField(data, end, &key)) {
+                return false;
+            }
+            conn->pending++;
+            runOnShard(shardOf(key), [=] {
+                readReplicas(key, consistency, [=](uint8_t found, const string &value) mutable {
+                    // A missing key is sent as not found with an empty value
+                    appendField(reply, found);
+                    appendValue(reply, value.data(), found == READ_FOUND ? value.size() : 0);
+                    endFrame(reply, start);
+                    answerRequest(conn, origin, reply, METRIC_READ, started);
+                });
+            });
+            return true;
+        case OP_FETCH:
+            if (!readField(data, end, &key)) {
+                return false;
+            }
+            conn->pending++;
+            runOnShard(shardOf(key), [=]() mutable {
+                string value;
+                uint64_t version = 0;
+                bool found = readStore(key, &value, &version);
+                appendField<uint8_t>(reply, found);
+                if (found) {
+                    appendEntry(reply, key, value.data(), value.size(), version);
+                }
+                endFrame(reply, start);
+                answerRequest(conn, origin, reply, METRIC_READ, started);
+            });
+            return true;
+        case OP_SET:
+        case OP_REPLICATE: {
+            // A replicated write is written without propigation, with the version of the server that coordinated it
+            StoreEntry entry;
+            entry.version = 0;
+            if (op == OP_SET ? !readField(data, end, &key) || !readValue(data, end, &bytes, &length)
+                                    : !readEntry(data, end, &entry, &bytes)) {
+                return false;
+            }
+            if (op == OP_SET) {
+                entry.key = key;
+            }
+            bool propigate = op == OP_SET;
+            string value(bytes, propigate ? length : entry.length);
+            int metric = propigate ? METRIC_WRITE : METRIC_REPLICATE_WRITE;
+            conn->pending++;
+            runOnShard(shardOf(entry.key), [=] {
+                writeStore(
+                    entry.key, value, propigate, entry.version,
+                    [=](bool ok) mutable {
+                        appendField<uint8_t>(reply, ok);
+                        endFrame(reply, start);
+                        answerRequest(conn, origin, reply, metric, started);
+                    },
+                    consistency);
+            });
+            return true;
+        }
+        case OP_MGET:
+        case OP_MSET:
+        case OP_REPLICATE_BATCH: {
+            if (!readField(data, end, &count)) {
+                return false;
+            }
+            // A replicated batch is written like an MSET without propigation, with the versions it carries
+            bool replicated = op == OP_REPLICATE_BATCH;
+            bool write = op != OP_MGET;
+            // Reads above ONE wait for peers, so each key is answered on its own
+            bool consistentRead = !write && consistencyCopies(consistency, false) > 1;
+            vector<uint64_t> keys(count);
+            vector<string> values(write ? count : 0);
+            vector<uint64_t> versions(count, 0);
+            for (int i = 0; i < count; i++) {
+                StoreEntry entry;
+                if (replicated) {
+                    if (!readEntry(data, end, &entry, &bytes)) {
+                        return false;
+                    }
+                    keys[i] = entry.key;
+                    versions[i] = entry.version;
+                    values[i].assign(bytes, entry.length);
+                    continue;
+                }
+                if (!readField(data, end, &keys[i]) || (write && !readValue(data, end, &bytes, &length))) {
+                    return false;
+                }
+                if (write) {
+                    values[i].assign(bytes, length);
+                }
+            }
+            // Group the keys by the shard owning them
+            vector<vector<int> > groups(shardCount);
+            for (int i = 0; i < count; i++) {
+                groups[shardOf(keys[i])].push_back(i);
+            }
+            shared_ptr<MultiRequest> multi = make_shared<MultiRequest>();
+            multi->found.resize(count);
+            multi->values.resize(write ? 0 : count);
+            multi->remaining = write || consistentRead ? count : 0;
+            for (int shard = 0; shard < shardCount && !write && !consistentRead; shard++) {
+                multi->remaining += !groups[shard].empty();
+            }
+            int metric = replicated ? METRIC_REPLICATE_WRITE : write ? METRIC_MSET : METRIC_MGET;
+            // Runs on the shard of the connection each time a part is answered
+            auto partDone = [=]() mutable {
+                if (--multi->remaining > 0) {
+                    return;
+                }
+                appendField(reply, count);
+                for (int i = 0; i < count; i++) {
+                    appendField(reply, multi->found[i]);
+                    if (!write) {
+                        appendValue(reply, multi->values[i].data(), multi->values[i].size());
+                    }
+                }
+                endFrame(reply, start);
+                finishRequest(conn, reply, metric, started);
+            };
+            conn->pending++;
+            if (count == 0) {
+                multi->remaining = 1;
+                partDone();
+                return true;
+            }
+            for (int shard = 0; shard < shardCount; shard++) {
+                if (groups[shard].empty()) {
+                    continue;
+                }
+                vector<int> group = groups[shard];
+                for (size_t i = 0; consistentRead && i < group.size(); i++) {
+                    int index = group[i];
+                    runOnShard(shard, [=] {
+                        readReplicas(keys[index], consistency, [=](uint8_t found, const string &value) {
+                            runOnShard(origin, [=]() mutable {
+                                multi->found[index] = found;
+                                multi->values[index] = value;
+                                partDone();
+                            });
+                        });
+                    });
+                }
+                if (consistentRead) {
+                    continue;
+                }
+                if (!write) {
+                    runOnShard(shard, [=] {
+                        vector<uint8_t> found(group.size());
+                        vector<string> foundValues(group.size());
+                        for (size_t i = 0; i < group.size(); i++) {
+                            found[i] = readStore(keys[group[i]], &foundValues[i]);
+                        }
+                        runOnShard(origin, [=]() mutable {
+                            for (size_t i = 0; i < group.size(); i++) {
+                                multi->found[group[i]] = found[i];
+                                multi->values[group[i]] = foundValues[i];
+                            }
+                            partDone();
+                        });
+                    });
+                    continue;
+                }
+                // Every key is queued for its replicas before waiting for any of them, and logged with the same sync
+                for (size_t i = 0; i < group.size(); i++) {
+                    int index = group[i];
+                    string value = values[index];
+                    runOnShard(shard, [=] {
+                        writeStore(
+                            keys[index], value, !replicated, versions[index],
+                            [=](bool ok) {
+                                runOnShard(origin, [=]() mutable {
+                                    multi->found[index] = ok;
+                                    partDone();
+                                });
+                            },
+                            consistency);
+                    });
+                }
+            }
+            return true;
+        }
+        case OP_PING:
+            endFrame(reply, start);
+            sendReply(conn, reply);
+            return true;
+        case OP_MERKLE_NODES:
+        case OP_MERKLE_KEYS: {
+            // Trees and stores are read lock free, nodes are answered right here, keys on a local thread
+            uint16_t set;
+            if (!readField(data, end, &set) || !readField(data, end, &count)) {
+                return false;
+            }
+            vector<uint32_t> nodes(count);
+            for (int i = 0; i < count; i++) {
+                if (!readField(data, end, &nodes[i]) ||
+                    nodes[i] >= (op == OP_MERKLE_NODES ? 2 * merkleLeaves : merkleLeaves)) {
+                    return false;
+                }
+            }
+            MerkleTree *tree = set < ring.setCount() ? merkleTrees[set] : NULL;
+            if (!tree) {
+                count = 0;
+            }
+            if (op == OP_MERKLE_NODES) {
+                appendField(reply, count);
+                for (int i = 0; i < count; i++) {
+                    appendField(reply, tree->hash(nodes[i]));
+                }
+                endFrame(reply, start);
+                sendReply(conn, reply);
+                return true;
+            }
+            conn->pending++;
+            runOnLocalThread([=]() mutable {
+                // Leaves are answered whole, the first one always, the next ones while the reply fits in a frame
+                vector<char> pairs;
+                unsigned short answered = 0;
+                for (; answered < count; answered++) {
+                    size_t before = pairs.size();
+                    forEachLeafKey(set, nodes[answered], storeLatest,
+                                   [&](uint64_t key, const char *, uint32_t, uint64_t version) {
+                        appendField(pairs, key);
+                        appendField(pairs, version);
+                    });
+                    if (answered > 0 && pairs.size() + 8 > maxFramePayload) {
+                        pairs.resize(before);
+                        break;
+                    }
+                }
+                appendField(reply, answered);
+                appendField<uint32_t>(reply, pairs.size() / (2 * sizeof(uint64_t)));
+                reply.insert(reply.end(), pairs.begin(), pairs.end());
+                endFrame(reply, start);
+                answerRequest(conn, origin, reply, -1, started);
+            });
+            return true;
+        }
+        case OP_SCAN:
+        case OP_SCAN_LOCAL: {
+            uint64_t first, last;
+            unsigned short limit;
+            if (!readField(data, end, &first) || !readField(data, end, &last) || !readField(data, end, &limit)) {
+                return false;
+            }
+            limit = limit == 0 || limit > scanMaxKeys ? scanMaxKeys : limit;
+            if (op == OP_SCAN_LOCAL) {
+                // A range of our stores is walked under their order locks, on a local thread
+                vector<bool> sets(ring.setCount(), false);
+                if (!readField(data, end, &count)) {
+                    return false;
+                }
+                for (int i = 0; i < count; i++) {
+                    uint16_t set;
+                    if (!readField(data, end, &set) || set >= sets.size()) {
+                        return false;
+                    }
+                    sets[set] = true;
+                }
+                conn->pending++;
+                runOnLocalThread([=]() mutable {
+                    ScanPart part;
+                    if (first <= last) {
+                        part = scanLocal(first, last, limit, sets);
+                    }
+                    appendField<uint8_t>(reply, part.truncated);
+                    appendScanEntries(reply, part);
+                    endFrame(reply, start);
+                    answerRequest(conn, origin, reply, -1, started);
+                });
+                return true;
+            }
+            // Peers are asked one after the other, on a peer thread
+            conn->pending++;
+            runOnPeerThread([=]() mutable {
+                ScanPart page;
+                bool ok = first > last || scanCluster(first, last, limit, &page);
+                // A page ending at the last key there is has nothing after it
+                bool more = page.truncated && !page.entries.empty() && page.entries.back().key < last;
+                appendField<uint8_t>(reply, ok);
+                appendField<uint8_t>(reply, more);
+                appendField<uint64_t>(reply, more ? page.entries.back().key + 1 : 0);
+                appendScanEntries(reply, page);
+                endFrame(reply, start);
+                answerRequest(conn, origin, reply, METRIC_SCAN, started);
+            });
+            return true;
+        }
+        case OP_STATS: {
+            // The report merges the histograms of every thread and health checks poll it, it is built on a local thread
+            conn->pending++;
+            runOnLocalThread([=]() mutable {
+                string report = metricsReport();
+                reply.insert(reply.end(), report.begin(), report.end());
+                endFrame(reply, start);
+                answerRequest(conn, origin, reply, -1, started);
+            });
+            return true;
+        }
+        default:
+            LOG_WARN("Invalid frame operation %d", (int)header.op);
+            return false;
     }
-    sockaddr_in service;  // initialising service as sockaddr_in structure
-    service.sin_family = AF_INET;
-    service.sin_addr.s_addr = inet_addr(hosts[hostIndex]);
-    service.sin_port = htons(port);
-    if (bind(serverSocket, (struct sockaddr *)&service, sizeof(service)) < 0) {
-        cout << "bind() failed: " << strerror(errno) << endl;
-        close(serverSocket);
-        exit(1);
+}
+
+// Wait for the next message on a connection without holding the shard, and for room in its socket if replies wait
+// A connection over connectionOutputLimit only waits for room
+void rearmConnection(Connection *conn) {
+    conn->serving = false;
+    epoll_event event;
+    event.events = (conn->out.size() - conn->outSent > connectionOutputLimit ? 0 : EPOLLIN) |
+                   (conn->out.empty() ? 0 : EPOLLOUT) | EPOLLONESHOT;
+    event.data.ptr = conn;
+    epoll_ctl(shards[conn->shard]->epollFd, EPOLL_CTL_MOD, conn->socket, &event);
+}
+
+// Close a connection, it is freed once the requests still running for it are answered
+void closeConnection(Connection *conn) {
+    close(conn->socket);
+    conn->socket = -1;
+    if (conn->pending == 0) {
+        delete conn;
     }
+}
 
-    // 4. Listen to incomming connections
-    if (listen(serverSocket, 1) < 0) {
-        cout << "listen(): Error listening on socket: " << strerror(errno) << endl;
-        exit(1);
+// Process every complete message buffered on a connection, then read what is available on it
+// Connections stay open until the other side closes them, so peers and framed clients can reuse them
+void serveConnection(Connection *conn) {
+    conn->serving = true;
+    if (!flushConnection(conn)) {
+        closeConnection(conn);
+        return;
+    }
+    while (true) {
+        size_t consumed = 0;
+        while (true) {
+            long length = messageLength(conn->buffer.data() + consumed, conn->buffer.size() - consumed);
+            if (length == 0) {
+                break;
+            }
+            const char *message = conn->buffer.data() + consumed;
+            bool framed = isFrame(message, length);
+            if (length < 0 || (framed && !handleFrame(conn, message))) {
+                LOG_WARN("Invalid message, closing connection");
+                closeConnection(conn);
+                return;
+            }
+            consumed += length;
+            if (!framed && !handleMessage(conn, message)) {
+                return;
+            }
+        }
+        conn->buffer.erase(conn->buffer.begin(), conn->buffer.begin() + consumed);
+        if (conn->out.size() - conn->outSent > connectionOutputLimit) {
+            // Read no more requests until the client takes its replies
+            rearmConnection(conn);
+            return;
+        }
+
+        size_t offset = conn->buffer.size();
+        conn->buffer.resize(offset + connectionReadSize);
+        int rbyteCount = recv(conn->socket, conn->buffer.data() + offset, connectionReadSize, MSG_DONTWAIT);
+        conn->buffer.resize(offset + max(rbyteCount, 0));
+        if (rbyteCount < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            rearmConnection(conn);
+            return;
+        }
+        if (rbyteCount <= 0) {
+            if (rbyteCount < 0) {
+                LOG_WARN("Server recv error: %s", strerror(errno));
+            }
+            closeConnection(conn);
+            return;
+        }
     }
+}
 
-    // Accepting new incoming messages
-    int acceptSocket;
+// Run the tasks posted to a shard, and the ones whose log sync is done
+void runShardTasks(Shard &shard) {
+    ShardTask task;
+    for (size_t i = 0; i < shard.inbound.size(); i++) {
+        while (shard.inbound[i]->pop(task)) {
+            task();
+        }
+    }
+    vector<ShardTask> inbox;
+    {
+        lock_guard<mutex> lock(shard.inboxLock);
+        inbox.swap(shard.inbox);
+    }
+    for (size_t i = 0; i < inbox.size(); i++) {
+        inbox[i]();
+    }
+    if (!shard.durableWaiters.empty()) {
+        uint64_t durable = walDurable;
+        vector<pair<uint64_t, ShardTask> > waiting;
+        waiting.swap(shard.durableWaiters);
+        for (size_t i = 0; i < waiting.size(); i++) {
+            if (waiting[i].first <= durable) {
+                waiting[i].second();
+            } else {
+                shard.durableWaiters.push_back(move(waiting[i]));
+            }
+        }
+    }
+}
 
-    unsigned short int incoming[3];
-    int rbyteCount;
-    printf("Server Started at %s:%d\n", hosts[hostIndex], port);
+// Shard thread, pinned to a core: accepts on the shard's listener, serves its connections and runs its tasks
+void shardThread(int index) {
+    currentShard = index;
+    Shard &shard = *shards[index];
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(index % max(1u, thread::hardware_concurrency()), &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
 
-    // We listen for incoming requests
+    epoll_event events[64];
     while (true) {
-        acceptSocket = accept(serverSocket, NULL, NULL);
-        if (acceptSocket < 0) {
-            cout << "accept meesage failed: " << strerror(errno) << endl;
+        int eventCount = epoll_wait(shard.epollFd, events, 64, -1);
+        if (eventCount < 0) {
+            if (errno != EINTR) {
+                LOG_ERROR("epoll_wait(): %s", strerror(errno));
+            }
             continue;
         }
-        rbyteCount = recv(acceptSocket, incoming, sizeof(incoming), 0);
-        if (rbyteCount < 0 && rbyteCount != 6) {
-            cout << "Server recv error: " << strerror(errno) << endl;
-        } else {
-            unsigned short int value;
-            unsigned short int didWrite;
-            // Process message here
-            printf("[S] Server recv %d, %d, %d\n", incoming[0], incoming[1], incoming[2]);
-            switch (incoming[0]) {
-                case READ_REQUEST:  // Read
-                    value = readStore(incoming[1]);
-                    send(acceptSocket, &value, sizeof(value), 0);
-                    break;
-                case WRITE_REQUEST:  // Write
-                    didWrite = writeStore(incoming[1], incoming[2]);
-                    send(acceptSocket, &didWrite, sizeof(didWrite), 0);
-                    break;
-                case RECOVER_REQUEST:  // Recovery Request
-                    // message = {r, hostIndex, null}
-                    thread(recoverHost, incoming[1], acceptSocket).detach();
-                    continue;  // So we dont close the socket, it will be closed once the thread finishes
-                    break;
-                case REPLICATE_WRITE:                             // Replicate write command
-                    writeStore(incoming[1], incoming[2], false);  // we write it without propigation
-                    send(acceptSocket, &incoming[1], sizeof(incoming[1]), 0);
-                    break;
-                default:
-                    cout << "Invalid message type" << endl;
+        for (int i = 0; i < eventCount; i++) {
+            if (events[i].data.ptr == &shard) {
+                // Tasks were posted, they run below
+                uint64_t posted;
+                read(shard.wakeFd, &posted, sizeof(posted));
+            } else if (events[i].data.ptr == NULL) {
+                // Accept every pending connection, registered one shot so a recovery thread can take one over
+                while (true) {
+                    int acceptSocket = accept4(shard.listener, NULL, NULL, SOCK_NONBLOCK);
+                    if (acceptSocket < 0) {
+                        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                            LOG_WARN("accept meesage failed: %s", strerror(errno));
+                        }
+                        break;
+                    }
+                    addCounter(COUNTER_ACCEPTED);
+                    Connection *conn = new Connection();
+                    conn->socket = acceptSocket;
+                    conn->shard = index;
+                    epoll_event connEvent;
+                    connEvent.events = EPOLLIN | EPOLLONESHOT;
+                    connEvent.data.ptr = conn;
+                    epoll_ctl(shard.epollFd, EPOLL_CTL_ADD, acceptSocket, &connEvent);
+                }
+            } else {
+                serveConnection((Connection *)events[i].data.ptr);
             }
-            close(acceptSocket);
         }
+        runShardTasks(shard);
+    }
+}
+
+// Create the shards and their stores, before anything reads or writes a key
+void createShards() {
+    for (int i = 0; i < shardCount; i++) {
+        Shard *shard = new Shard();
+        shard->index = i;
+        shard->listener = -1;
+        for (int from = 0; from < shardCount; from++) {
+            shard->inbound.push_back(new SpscQueue<ShardTask>(shardQueueSize));
+        }
+        shard->wakeFd = eventfd(0, EFD_NONBLOCK);
+        shard->epollFd = epoll_create1(0);
+        if (shard->wakeFd < 0 || shard->epollFd < 0) {
+            LOG_ERROR("Error creating shard %d: %s", i, strerror(errno));
+            exit(1);
+        }
+        epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = shard;
+        epoll_ctl(shard->epollFd, EPOLL_CTL_ADD, shard->wakeFd, &event);
+        shards.push_back(shard);
+    }
+}
+
+// Socket server initialized: one listener per shard on the same port, the kernel spreads connections over them
+void socketServer() {
+    for (int i = 0; i < shardCount; i++) {
+        Shard &shard = *shards[i];
+        shard.listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (shard.listener < 0) {
+            LOG_ERROR("Error at socket(): %s", strerror(errno));
+            exit(1);
+        }
+        int opt = 1;
+        setsockopt(shard.listener, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        setsockopt(shard.listener, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+        sockaddr_in service;  // initialising service as sockaddr_in structure
+        service.sin_family = AF_INET;
+        service.sin_addr.s_addr = inet_addr(cluster.hosts[hostIndex].c_str());
+        service.sin_port = htons(cluster.ports[hostIndex]);
+        if (bind(shard.listener, (struct sockaddr *)&service, sizeof(service)) < 0) {
+            LOG_ERROR("bind() failed: %s", strerror(errno));
+            exit(1);
+        }
+
+        // 4. Listen to incomming connections
+        if (listen(shard.listener, acceptBacklog) < 0) {
+            LOG_ERROR("listen(): Error listening on socket: %s", strerror(errno));
+            exit(1);
+        }
+        // The listening socket is the only event without a connection or shard attached
+        epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        epoll_ctl(shard.epollFd, EPOLL_CTL_ADD, shard.listener, &event);
     }
+    LOG_INFO("Server Started at %s:%d with %d shards", cluster.hosts[hostIndex].c_str(), cluster.ports[hostIndex],
+           shardCount);
+
+    // Shard 0 runs on this thread
+    for (int i = 1; i < shardCount; i++) {
+        thread(shardThread, i).detach();
+    }
+    shardThread(0);
 }
 
 void commandThread() {
     char cmd;
-    unsigned short int value;
-    printf("Commands Read, Write, Print, Count, Generate, Quit, XRecover [r,w,p,c,g,q,x]:\n");
+    string value;
+    printf("Commands Read, Write, Print, Count, Generate, Quit, XRecover, Stats [r,w,p,c,g,q,x,s]:\n");
     while (true) {
         cmd = getChar();
         cout << endl;
         switch (cmd) {
             case 'r':
                 // Read
-                value = readStore(hostIndex);
+                value.clear();
+                readStore(hostIndex, &value);
                 cout << "Value: " << value << endl;
                 break;
             case 'w':
                 // Write
-                writeStore(hostIndex + 7 - 1, randNum(1, 100));
+                writeStore(hostIndex + 7 - 1, to_string(randNum(1, 100)));
                 break;
             case 'p':
                 // Print store values
-                for (int i = 0; i < storeIndex; i++) {
-                    cout << store[i][0] << ":" << store[i][1] << ":" << hashKey(store[i][0]) + 1 << endl;
-                }
+                forEachStoreKey([](uint64_t key, const char *value, uint32_t length, uint64_t version) {
+                    cout << key << ":" << string(value, length) << ":" << hashKey(key) + 1 << endl;
+                });
                 break;
             case 'g':  // Generate
                 for (int i = 0; i < 20; i++) {
-                    writeStore(randNum(1, 100) * 7 + hostIndex, randNum(1, 1000));
+                    // Pick keys we own on the ring
+                    uint64_t key;
+                    do {
+                        key = ((uint64_t)rand() << 32) | rand();
+                    } while (hashKey(key) != hostIndex);
+                    writeStore(key, to_string(randNum(1, 1000)));
                 }
                 break;
             case 'c':
                 // count
-                cout << "Store size: " << storeIndex << endl;
+                cout << "Store size: " << storeCount() << endl;
                 break;
             case 'q':
                 // Quit
-                close(serverSocket);
+                for (size_t i = 0; i < shards.size(); i++) {
+                    close(shards[i]->listener);
+                }
                 exit(0);
                 break;
             case 'x':
                 // Recover
                 thread(recoverKeys).detach();
                 break;
+            case 's':
+                // Metrics
+                cout << metricsReport();
+                break;
             default:
                 cout << "Invalid command" << endl;
         }
@@ -390,27 +2855,92 @@ int main(int argc, char *argv[]) {
     sa.sa_flags = SA_SIGINFO;  // Important: get more info
 
     sigaction(SIGSEGV, &sa, nullptr);
+    // sendfile has no MSG_NOSIGNAL, a recovering peer going away must not kill us
+    signal(SIGPIPE, SIG_IGN);
 
     // if no argument is passed, exit
     if (argc < 2) {
         cout << "Project 3 by: Osamah Alzacko & Anurag" << endl;
-        cout << "Servers we are going to use: DC01, DC02, DC03, DC04, DC05, DC06, DC07" << endl;
-        cout << "Its hardcoded, so we need to use those servers." << endl;
-        cout << "Usage: ./server {id}" << endl;
-        cout << "id: [1-5] has to be from 1 to 5 for each process" << endl;
+        cout << "Servers are listed in config.txt as serverN=host[:port], or in the file named by KV_CONFIG" << endl;
+        cout << "KV_RECOVER=0 skips the recovery from peers at startup, anti-entropy brings back what was missed"
+             << endl;
+        cout << "Usage: ./server {id} [shards] [acks] [window]" << endl;
+        cout << "id: number N of the serverN line of this process" << endl;
+        cout << "shards: number of shards, each a thread pinned to a core, default one per core" << endl;
+        cout << "acks: replica acks needed before a write is acknowledged, below replicas, default " << writeAcks
+             << endl;
+        cout << "window: microseconds a replication batch waits for more writes, default " << replicationWindow
+             << endl;
+        return 1;
+    }
+    if (!loadClusterConfig(clusterConfigPath(), cluster)) {
+        cout << "Can not read servers from " << clusterConfigPath() << endl;
         return 1;
     }
+    ring.build(cluster);
     // get first agrument as id
     dcId = atoi(argv[1]);
 
     // Validate input
-    if (dcId < 1 || dcId > 5) {
+    if (dcId < 1 || dcId > (int)cluster.hosts.size()) {
         cout << "Invalid id" << endl;
         return 1;
     }
 
+    if (argc > 2) {
+        shardCount = atoi(argv[2]);
+        if (shardCount < 1) {
+            cout << "Invalid shards count" << endl;
+            return 1;
+        }
+    }
+    if (argc > 3) {
+        writeAcks = atoi(argv[3]);
+        if (writeAcks < 0 || writeAcks > ring.replicaCount - 1) {
+            cout << "Invalid acks count" << endl;
+            return 1;
+        }
+    }
+    if (argc > 4) {
+        replicationWindow = atoi(argv[4]);
+        if (replicationWindow < 0) {
+            cout << "Invalid replication window" << endl;
+            return 1;
+        }
+    }
+
     // Init variables
     hostIndex = dcId - 1;
+    logStart();
+
+    createShards();
+    merkleTrees.assign(ring.setCount(), NULL);
+    for (int set = 0; set < ring.setCount(); set++) {
+        if (ring.isSetHolder(set, hostIndex)) {
+            merkleTrees[set] = new MerkleTree();
+        }
+    }
+    // Come back warm from the local snapshot and log, peers only have to send what changed since
+    loadLocalState();
+    for (int range = 0; range < (int)cluster.hosts.size(); range++) {
+        recoverySince[range] = rangeHighWater[range].load();
+    }
+    thread(walThread).detach();
+    thread(snapshotThread).detach();
+
+    for (int i = 0; i < peerThreadCount; i++) {
+        thread(peerThread).detach();
+    }
+    for (int i = 0; i < localThreadCount; i++) {
+        thread(localThread).detach();
+    }
+    for (int i = 0; i < (int)cluster.hosts.size(); i++) {
+        if (i != hostIndex) {
+            thread(replicationThread, i).detach();
+        }
+    }
+    thread(heartbeatThread).detach();
+    thread(antiEntropyThread).detach();
 
     // First of all, we run the server
     thread th1(socketServer);
@@ -419,6 +2949,11 @@ int main(int argc, char *argv[]) {
     thread th2(commandThread);
 
     usleep(100 * 1000);
+    // Catch up on the writes we missed while we were down, unless they are left to anti-entropy
+    const char *recover = getenv("KV_RECOVER");
+    if (!recover || strcmp(recover, "0") != 0) {
+        thread(recoverKeys).detach();
+    }
     // Start boradcasting messages to other processes
     // Wait for the thread to finish
     th1.join();
@@ -0,0 +1,43 @@
+// Merkle trees of the keys a server holds, one per replica set it is in, compared with the other holders of the set
+// to find the keys one of them missed
+//
+// A tree has merkleLeaves leaves and a key goes to the leaf picked by the low bits of its ring hash, the same bits
+// the store orders its list by, so the keys of a leaf are read without a scan of the whole store. A leaf hash is the
+// XOR of the digests of its keys, a digest mixing a key with its version, and an inner node is the XOR of its
+// children. A write XORs the change of its digest into its leaf and every node above it, lock free, so a tree is
+// always current and never rebuilt.
+//
+// Nodes are numbered as a heap: the root is 1, the children of n are 2n and 2n + 1, and leaf i is merkleLeaves + i.
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include "cluster.h"
+
+const int merkleDepth = 10;
+const uint32_t merkleLeaves = 1 << merkleDepth;
+
+inline uint32_t merkleLeafOf(uint64_t key) { return ringHash(key) & (merkleLeaves - 1); }
+
+inline uint64_t merkleDigest(uint64_t key, uint64_t version) { return ringHash(key ^ ringHash(version)); }
+
+struct MerkleTree {
+    std::atomic<uint64_t> nodes[2 * merkleLeaves];
+
+    MerkleTree() {
+        for (uint32_t i = 0; i < 2 * merkleLeaves; i++) {
+            nodes[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // A key went from previousVersion, 0 if it was not held, to version
+    void update(uint64_t key, uint64_t previousVersion, uint64_t version) {
+        uint64_t change = merkleDigest(key, version) ^ (previousVersion ? merkleDigest(key, previousVersion) : 0);
+        for (uint32_t node = merkleLeaves + merkleLeafOf(key); node >= 1; node /= 2) {
+            nodes[node].fetch_xor(change, std::memory_order_relaxed);
+        }
+    }
+
+    uint64_t hash(uint32_t node) const { return nodes[node].load(std::memory_order_relaxed); }
+};
@@ -0,0 +1,122 @@
+// Server metrics: every thread records into its own block of latency histograms and counters, so recording never
+// takes a lock or shares a cache line with another thread. A report merges the blocks of every thread.
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "cluster.h"
+#include "histogram.h"
+
+// Peers a metric can be kept for, one per server of the cluster
+const int metricsMaxPeers = maxHosts;
+
+// Latency histograms, in nanoseconds
+#define METRIC_READ 0
+#define METRIC_WRITE 1
+#define METRIC_REPLICATE_WRITE 2
+#define METRIC_MGET 3
+#define METRIC_MSET 4
+#define METRIC_SCAN 5
+#define METRIC_PROPAGATE 6  // + peer index, round trip of a replica write to that peer
+const int metricCount = METRIC_PROPAGATE + metricsMaxPeers;
+
+// Counters
+#define COUNTER_ACCEPTED 0               // connections accepted
+#define COUNTER_RECOVERY_SENT 1          // bytes streamed to recovering peers
+#define COUNTER_RECOVERED_KEYS 2         // keys received while recovering
+#define COUNTER_RECOVERED_BYTES 3        // bytes received while recovering
+#define COUNTER_RECOVERY_NANOS 4         // time spent recovering
+#define COUNTER_HINTS_QUEUED 5           // replica writes kept for a peer that was down
+#define COUNTER_HINTS_REPLAYED 6         // kept replica writes delivered once their peer was back
+#define COUNTER_HINTS_DROPPED 7          // replica writes not kept, the queue of their peer was full
+#define COUNTER_READ_REPAIRS 8           // stale or missing replica copies fixed by a consistent read
+#define COUNTER_REPLICATION_BATCHES 9    // batches of replica writes sent to peers
+#define COUNTER_REPLICATION_WRITES 10    // replica writes sent in those batches
+#define COUNTER_REPLICATION_COALESCED 11 // replica writes not sent, a newer write of their key was in the same batch
+#define COUNTER_ANTI_ENTROPY_LEAVES 12   // Merkle leaves found to differ from a peer
+#define COUNTER_ANTI_ENTROPY_KEYS 13     // keys sent to a peer holding an older version or none
+#define COUNTER_PROPAGATE_ERRORS 14      // + peer index, replica writes that failed
+const int counterCount = COUNTER_PROPAGATE_ERRORS + metricsMaxPeers;
+
+struct ThreadMetrics {
+    LatencyHistogram histograms[metricCount];
+    std::atomic<uint64_t> counters[counterCount];
+
+    ThreadMetrics() {
+        for (int i = 0; i < counterCount; i++) {
+            counters[i].store(0, std::memory_order_relaxed);
+        }
+    }
+};
+
+// Every block ever handed out, blocks of finished threads are kept (with their counts) and reused
+struct MetricsRegistry {
+    std::mutex lock;
+    std::vector<ThreadMetrics *> blocks;
+    std::vector<ThreadMetrics *> free;
+};
+
+inline MetricsRegistry &metricsRegistry() {
+    static MetricsRegistry registry;
+    return registry;
+}
+
+// Owns the block of the current thread and gives it back when the thread ends
+struct ThreadMetricsHandle {
+    ThreadMetrics *block;
+
+    ThreadMetricsHandle() {
+        MetricsRegistry &registry = metricsRegistry();
+        std::lock_guard<std::mutex> guard(registry.lock);
+        if (!registry.free.empty()) {
+            block = registry.free.back();
+            registry.free.pop_back();
+        } else {
+            block = new ThreadMetrics();
+            registry.blocks.push_back(block);
+        }
+    }
+
+    ~ThreadMetricsHandle() {
+        MetricsRegistry &registry = metricsRegistry();
+        std::lock_guard<std::mutex> guard(registry.lock);
+        registry.free.push_back(block);
+    }
+};
+
+inline ThreadMetrics &threadMetrics() {
+    static thread_local ThreadMetricsHandle handle;
+    return *handle.block;
+}
+
+// Record the time elapsed since started
+inline void recordLatency(int metric, std::chrono::steady_clock::time_point started) {
+    threadMetrics().histograms[metric].record(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started).count());
+}
+
+inline void addCounter(int counter, uint64_t amount = 1) {
+    std::atomic<uint64_t> &value = threadMetrics().counters[counter];
+    value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+// Sum the blocks of every thread into histograms[metricCount] and counters[counterCount]
+inline void mergeMetrics(LatencyHistogram *histograms, uint64_t *counters) {
+    MetricsRegistry &registry = metricsRegistry();
+    std::lock_guard<std::mutex> guard(registry.lock);
+    for (int i = 0; i < counterCount; i++) {
+        counters[i] = 0;
+    }
+    for (size_t b = 0; b < registry.blocks.size(); b++) {
+        for (int i = 0; i < metricCount; i++) {
+            histograms[i].merge(registry.blocks[b]->histograms[i]);
+        }
+        for (int i = 0; i < counterCount; i++) {
+            counters[i] += registry.blocks[b]->counters[i].load(std::memory_order_relaxed);
+        }
+    }
+}
@@ -0,0 +1,355 @@
+// Microbenchmarks of the server hot paths, in one process without a cluster:
+// - store reads and writes at 1K to 1M keys: the work of readStore, and of storePut with its Merkle tree update
+// - ordered scans of the store
+// - snapshot walks of the store while a writer rewrites it, each snapshot checked to be an exact cut of the writes
+// - hashKey and isKeyRelatedToHost, the owner and replica lookups on the hash ring
+// - encode and decode of GET, SET and MSET frames and of the entries of replica writes and recovery
+// The network, log and replication side of a write is measured end to end by loopbench.sh.
+// A snapshot that is not an exact cut, or versions kept after the last snapshot closed, fail the run.
+//
+// Every result is one JSON line on stdout:
+// {"bench": name, "keys": keys in the store or 0, "ops": operations timed, "ns_per_op": mean, "ops_per_sec": rate}
+//
+// Usage: ./microbench [filter] [millis]
+// filter: run only the benchmarks whose name contains it, default all
+// millis: time spent on each benchmark, default 200
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cluster.h"
+#include "merkle.h"
+#include "protocol.h"
+#include "store.h"
+
+using namespace std;
+
+const size_t storeSizes[] = {1000, 10000, 100000, 1000000};
+const size_t randomKeys = 1 << 16;
+const uint32_t valueLength = 8;
+const uint64_t snapshotKeys = 10000;
+
+string filter;
+long benchMillis = 200;
+HashRing ring;
+// Results are summed in here so the compiler keeps the work
+volatile uint64_t sink;
+
+// Memory may have changed, the compiler must not hoist a decode of the same bytes out of its loop
+inline void clobberMemory() { asm volatile("" : : : "memory"); }
+
+int hashKey(uint64_t key) { return ring.owner(key); }
+
+bool isKeyRelatedToHost(uint64_t key, int host) { return ring.isReplica(key, host); }
+
+void report(const string &name, size_t keys, uint64_t ops, double nanos) {
+    printf("{\"bench\": \"%s\", \"keys\": %zu, \"ops\": %llu, \"ns_per_op\": %.1f, \"ops_per_sec\": %.0f}\n",
+           name.c_str(), keys, (unsigned long long)ops, nanos / ops, ops / (nanos / 1e9));
+    fflush(stdout);
+}
+
+// Time fn(iterations), doubling iterations until one run takes benchMillis
+void bench(const string &name, size_t keys, function<void(uint64_t)> fn) {
+    if (name.find(filter) == string::npos) {
+        return;
+    }
+    for (uint64_t iterations = 1024;; iterations *= 2) {
+        auto started = chrono::steady_clock::now();
+        fn(iterations);
+        double nanos = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - started).count();
+        if (nanos >= benchMillis * 1e6 || iterations >= (uint64_t(1) << 40)) {
+            report(name, keys, iterations, nanos);
+            return;
+        }
+    }
+}
+
+void storeBenchmarks(size_t keys, const vector<uint64_t> &random) {
+    static const char *names[] = {"store_put_new", "store_get", "store_get_missing", "store_put_update",
+                                  "store_scan_100"};
+    bool selected = false;
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        selected |= string(names[i]).find(filter) != string::npos;
+    }
+    if (!selected) {
+        return;
+    }
+    Store *store = new Store();
+    MerkleTree *tree = new MerkleTree();
+    char value[valueLength];
+    memset(value, 'v', sizeof(value));
+    // Filling the store is timed once, every put links a new key
+    auto started = chrono::steady_clock::now();
+    for (size_t i = 0; i < keys; i++) {
+        store->put(i, value, sizeof(value), 1);
+    }
+    if (string("store_put_new").find(filter) != string::npos) {
+        report("store_put_new", keys, keys,
+               chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - started).count());
+    }
+    bench("store_get", keys, [&](uint64_t iterations) {
+        string read;
+        uint64_t version, sum = 0;
+        for (uint64_t i = 0; i < iterations; i++) {
+            sum += store->get(random[i & (randomKeys - 1)] % keys, &read, &version);
+        }
+        sink += sum;
+    });
+    bench("store_get_missing", keys, [&](uint64_t iterations) {
+        string read;
+        uint64_t sum = 0;
+        for (uint64_t i = 0; i < iterations; i++) {
+            sum += store->get(keys + random[i & (randomKeys - 1)] % keys, &read);
+        }
+        sink += sum;
+    });
+    // Like storePut: a newer version of a key and the change of its digest in the Merkle tree
+    uint64_t version = 1;
+    bench("store_put_update", keys, [&](uint64_t iterations) {
+        for (uint64_t i = 0; i < iterations; i++) {
+            uint64_t key = random[i & (randomKeys - 1)] % keys;
+            uint64_t replaced;
+            if (store->put(key, value, sizeof(value), ++version, &replaced) == PUT_UPDATED) {
+                tree->update(key, replaced, version);
+            }
+        }
+    });
+    bench("store_scan_100", keys, [&](uint64_t iterations) {
+        uint64_t sum = 0;
+        for (uint64_t i = 0; i < iterations; i++) {
+            uint64_t first = random[i & (randomKeys - 1)] % keys;
+            int taken = 0;
+            store->scan(first, UINT64_MAX, [&](uint64_t key, const char *, uint32_t length, uint64_t) {
+                sum += key + length;
+                return ++taken < 100;
+            });
+        }
+        sink += sum;
+    });
+    // The store never frees its nodes and slabs, a benchmark process can afford it
+    delete store;
+    delete tree;
+}
+
+// Snapshot walks while a writer thread rewrites the keys in turn, every write versioned and valued with its
+// sequence number: a snapshot must see every write up to the newest it sees and none after it, and every version
+// kept for it must be freed once no snapshot is open
+void snapshotBenchmark() {
+    const string name = "store_snapshot_walk";
+    if (name.find(filter) == string::npos) {
+        return;
+    }
+    Store *store = new Store();
+    for (uint64_t sequence = 1; sequence <= snapshotKeys; sequence++) {
+        store->put(sequence % snapshotKeys, (const char *)&sequence, sizeof(sequence), sequence);
+    }
+    atomic<bool> stop(false);
+    thread writer([&] {
+        for (uint64_t sequence = snapshotKeys + 1; !stop.load(memory_order_relaxed); sequence++) {
+            store->put(sequence % snapshotKeys, (const char *)&sequence, sizeof(sequence), sequence);
+        }
+    });
+    vector<uint64_t> seen(snapshotKeys);
+    bench(name, snapshotKeys, [&](uint64_t iterations) {
+        for (uint64_t i = 0; i < iterations; i++) {
+            bool exact = true;
+            StoreSnapshot snapshot(vector<Store *>(1, store));
+            uint64_t newest = 0;
+            snapshot.forEach([&](uint64_t key, const char *value, uint32_t length, uint64_t version) {
+                uint64_t written = 0;
+                memcpy(&written, value, min<size_t>(length, sizeof(written)));
+                exact &= length == sizeof(written) && written == version;
+                seen[key] = version;
+                newest = max(newest, version);
+            });
+            for (uint64_t key = 0; key < snapshotKeys; key++) {
+                exact &= seen[key] == newest - (newest - key) % snapshotKeys;
+            }
+            if (!exact) {
+                fprintf(stderr, "%s: a snapshot is not an exact cut of the writes\n", name.c_str());
+                exit(1);
+            }
+        }
+    });
+    stop = true;
+    writer.join();
+    // A put racing the close of the last snapshot keeps its version until the next one closes
+    {
+        StoreSnapshot closing(vector<Store *>(1, store));
+    }
+    if (store->historyVersions != 0) {
+        fprintf(stderr, "%s: %zu versions kept with no snapshot open\n", name.c_str(),
+                store->historyVersions.load());
+        exit(1);
+    }
+    delete store;
+}
+
+void ringBenchmarks(const vector<uint64_t> &random) {
+    bench("hash_key", 0, [&](uint64_t iterations) {
+        uint64_t sum = 0;
+        for (uint64_t i = 0; i < iterations; i++) {
+            sum += hashKey(random[i & (randomKeys - 1)]);
+        }
+        sink += sum;
+    });
+    bench("is_key_related_to_host", 0, [&](uint64_t iterations) {
+        uint64_t sum = 0;
+        for (uint64_t i = 0; i < iterations; i++) {
+            sum += isKeyRelatedToHost(random[i & (randomKeys - 1)], i % ring.hostCount);
+        }
+        sink += sum;
+    });
+    bench("replica_set_of", 0, [&](uint64_t iterations) {
+        uint64_t sum = 0;
+        for (uint64_t i = 0; i < iterations; i++) {
+            sum += ring.replicaSetOf(random[i & (randomKeys - 1)]);
+        }
+        sink += sum;
+    });
+}
+
+void protocolBenchmarks(const vector<uint64_t> &random) {
+    string value(100, 'v');
+    vector<char> frame;
+    bench("encode_get", 0, [&](uint64_t iterations) {
+        for (uint64_t i = 0; i < iterations; i++) {
+            frame.clear();
+            size_t start = beginFrame(frame, OP_GET, i);
+            appendField(frame, random[i & (randomKeys - 1)]);
+            endFrame(frame, start);
+        }
+        sink += frame.size();
+    });
+    bench("encode_set_100b", 0, [&](uint64_t iterations) {
+        for (uint64_t i = 0; i < iterations; i++) {
+            frame.clear();
+            size_t start = beginFrame(frame, OP_SET, i);
+            appendField(frame, random[i & (randomKeys - 1)]);
+            appendValue(frame, value.data(), value.size());
+            endFrame(frame, start);
+        }
+        sink += frame.size();
+    });
+    bench("decode_set_100b", 0, [&](uint64_t iterations) {
+        uint64_t sum = 0;
+        for (uint64_t i = 0; i < iterations; i++) {
+            clobberMemory();
+            FrameHeader header;
+            memcpy(&header, frame.data(), sizeof(header));
+            const char *data = frame.data() + sizeof(header);
+            const char *end = data + header.length;
+            uint64_t key;
+            const char *bytes;
+            uint32_t length;
+            if (isFrame(frame.data(), frame.size()) && readField(data, end, &key) &&
+                readValue(data, end, &bytes, &length)) {
+                sum += key + length;
+            }
+        }
+        sink += sum;
+    });
+    // An MSET of 100 keys, per key
+    bench("encode_mset_100x100b", 0, [&](uint64_t iterations) {
+        for (uint64_t i = 0; i < iterations; i += 100) {
+            frame.clear();
+            size_t start = beginFrame(frame, OP_MSET, i);
+            appendField<unsigned short>(frame, 100);
+            for (int j = 0; j < 100; j++) {
+                appendField(frame, random[(i + j) & (randomKeys - 1)]);
+                appendValue(frame, value.data(), value.size());
+            }
+            endFrame(frame, start);
+        }
+        sink += frame.size();
+    });
+    bench("decode_mset_100x100b", 0, [&](uint64_t iterations) {
+        uint64_t sum = 0;
+        for (uint64_t i = 0; i < iterations; i += 100) {
+            clobberMemory();
+            const char *data = frame.data() + sizeof(FrameHeader);
+            const char *end = frame.data() + frame.size();
+            unsigned short count = 0;
+            readField(data, end, &count);
+            for (int j = 0; j < count; j++) {
+                uint64_t key;
+                const char *bytes;
+                uint32_t length;
+                if (!readField(data, end, &key) || !readValue(data, end, &bytes, &length)) {
+                    break;
+                }
+                sum += key + length;
+            }
+        }
+        sink += sum;
+    });
+    // Entries of replica writes, snapshots and recovery segments, 1000 per buffer
+    vector<char> entries;
+    bench("encode_entry_100b", 0, [&](uint64_t iterations) {
+        for (uint64_t i = 0; i < iterations; i++) {
+            if (i % 1000 == 0) {
+                entries.clear();
+            }
+            appendEntry(entries, random[i & (randomKeys - 1)], value.data(), value.size(), i);
+        }
+        sink += entries.size();
+    });
+    bench("decode_entry_100b", 0, [&](uint64_t iterations) {
+        uint64_t sum = 0;
+        const char *data = entries.data();
+        const char *end = data + entries.size();
+        for (uint64_t i = 0; i < iterations; i++) {
+            clobberMemory();
+            StoreEntry entry = StoreEntry();
+            const char *bytes;
+            if (!readEntry(data, end, &entry, &bytes)) {
+                data = entries.data();
+                readEntry(data, end, &entry, &bytes);
+            }
+            sum += entry.key + entry.length;
+        }
+        sink += sum;
+    });
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1) {
+        filter = argv[1];
+    }
+    if (argc > 2) {
+        benchMillis = atol(argv[2]);
+        if (benchMillis < 1) {
+            fprintf(stderr, "Usage: ./microbench [filter] [millis]\n");
+            return 1;
+        }
+    }
+    // The layout of config.local.txt: 5 servers, 3 replicas
+    ClusterConfig config;
+    for (int i = 1; i <= 5; i++) {
+        config.hosts.push_back("127.0.0.1");
+        config.ports.push_back(4430 + i);
+    }
+    ring.build(config);
+    // Fixed seed, every run reads the same keys
+    mt19937_64 generator(42);
+    vector<uint64_t> random(randomKeys);
+    for (size_t i = 0; i < randomKeys; i++) {
+        random[i] = generator();
+    }
+    for (size_t i = 0; i < sizeof(storeSizes) / sizeof(storeSizes[0]); i++) {
+        storeBenchmarks(storeSizes[i], random);
+    }
+    snapshotBenchmark();
+    ringBenchmarks(random);
+    protocolBenchmarks(random);
+    return 0;
+}
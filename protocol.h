@@ -0,0 +1,192 @@
+// Wire protocol shared by the server and the client
+//
+// Two formats are accepted on the same port, told apart by the first 2 bytes:
+// - legacy messages, 3 unsigned short {type, key, value}, one request per connection
+// - frames, a FrameHeader starting with FRAME_MAGIC and a payload, any number of requests per connection
+// Every field is in host byte order, like the legacy messages.
+//
+// Keys are 64 bit and values are byte strings. A legacy message can only name keys up to 65535, and its value is
+// stored as decimal text so frames and legacy messages see the same data.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Legacy message types
+// Servers no longer send or accept the peer-only types 4 and 5, RECOVER_WRITE and REPLICATE_WRITE: recovery streams
+// RECOVER_SEGMENT and replica writes go as OP_REPLICATE_BATCH frames
+#define READ_REQUEST 1
+#define WRITE_REQUEST 2
+#define RECOVER_REQUEST 3
+#define RECOVER_END 6
+// {RECOVER_SEGMENT, 0, 0}, a u64 byte length, then that many bytes of entries, in answer to RECOVER_REQUEST
+#define RECOVER_SEGMENT 8
+
+// "KV", never a legacy message type
+#define FRAME_MAGIC 0x564B
+#define FRAME_VERSION 2
+
+// Frame operations, a reply carries the operation of its request with OP_REPLY set
+// OP_GET  {key}                          -> {found u8, value}
+// OP_SET  {key, value}                   -> {ok u8}
+// OP_MGET {count, count * key}           -> {count, count * {found u8, value}}
+// OP_MSET {count, count * {key, value}}  -> {count, count * ok u8}
+// OP_STATS {}                            -> text report of the server metrics
+// OP_REPLICATE {entry}                   -> {ok u8}, a versioned write sent by the server coordinating it
+// OP_PING {}                             -> {}, a heartbeat between servers
+// OP_FETCH {key}                         -> {found u8, entry if found}, the copy of a replica for a consistent read
+// OP_REPLICATE_BATCH {count, count * entry} -> {count, count * ok u8}, replica writes coalesced for one peer
+// OP_MERKLE_NODES {set u16, count, count * node u32} -> {count, count * hash u64}, nodes of the Merkle tree of a
+//                                                      replica set, count 0 if the server does not hold the set
+// OP_MERKLE_KEYS {set u16, count, count * leaf u32}  -> {count, pairs u32, pairs * {key, version}}, the keys held in
+//                                                      the first count leaves, as many as fit in a frame
+// OP_SCAN {start, end, limit}            -> {ok u8, more u8, next key, count, count * entry}, the first keys from start
+//                                           to end included in key order, up to limit and scanMaxBytes of entries;
+//                                           more is set if keys may follow, from next on. ok is 0 if a replica set
+//                                           had no live holder to ask
+// OP_SCAN_LOCAL {start, end, limit, count, count * set u16} -> {more u8, count, count * entry}, the same over the
+//                                           keys the server holds of some replica sets, sent by the server
+//                                           coordinating a scan
+// keys are u64, values are a u32 length and the bytes, counts are unsigned short, entries are a StoreEntry header
+// followed by the value bytes
+#define OP_GET 1
+#define OP_SET 2
+#define OP_MGET 3
+#define OP_MSET 4
+#define OP_STATS 5
+#define OP_REPLICATE 6
+#define OP_PING 7
+#define OP_FETCH 8
+#define OP_REPLICATE_BATCH 9
+#define OP_MERKLE_NODES 10
+#define OP_MERKLE_KEYS 11
+#define OP_SCAN 12
+#define OP_SCAN_LOCAL 13
+#define OP_REPLY 0x80
+#define OP_MASK 0x0F
+
+// Consistency level of a GET, SET, MGET or MSET, carried in bits 4 and 5 of its op: the replicas of a key that must
+// answer a read or hold a write before it is acknowledged. DEFAULT is ONE for reads and the server setting for writes
+#define CONSISTENCY_DEFAULT 0
+#define CONSISTENCY_ONE 1
+#define CONSISTENCY_QUORUM 2
+#define CONSISTENCY_ALL 3
+#define OP_CONSISTENCY_SHIFT 4
+
+// found byte of a GET or MGET reply
+#define READ_MISSING 0
+#define READ_FOUND 1
+// Fewer replicas than the consistency level answered
+#define READ_UNAVAILABLE 2
+
+// Largest payload a frame may carry, and largest value
+const uint32_t maxFramePayload = 1 << 20;
+const uint32_t maxValueLength = 512 * 1024;
+
+// Most keys and entry bytes in one scan page, a page always carries its first entry whatever its size
+const unsigned short scanMaxKeys = 1000;
+const uint32_t scanMaxBytes = maxFramePayload / 2;
+
+// One versioned key as sent in recovery batches and replica writes, and written to the log and snapshots,
+// followed by length value bytes
+struct __attribute__((packed)) StoreEntry {
+    uint64_t key;
+    uint64_t version;
+    uint32_t length;
+};
+
+struct __attribute__((packed)) FrameHeader {
+    uint16_t magic;
+    uint8_t version;
+    uint8_t op;
+    // Chosen by the sender of a request and echoed in its reply, so requests can be pipelined
+    uint32_t requestId;
+    // Payload bytes following the header
+    uint32_t length;
+};
+
+// Append a frame with its header to out, the payload is added by appendField calls and closed by endFrame
+inline size_t beginFrame(std::vector<char> &out, uint8_t op, uint32_t requestId) {
+    FrameHeader header;
+    header.magic = FRAME_MAGIC;
+    header.version = FRAME_VERSION;
+    header.op = op;
+    header.requestId = requestId;
+    header.length = 0;
+    size_t start = out.size();
+    out.insert(out.end(), (const char *)&header, (const char *)&header + sizeof(header));
+    return start;
+}
+
+template <typename T>
+inline void appendField(std::vector<char> &out, T value) {
+    out.insert(out.end(), (const char *)&value, (const char *)&value + sizeof(value));
+}
+
+inline uint8_t frameOp(uint8_t op, int consistency) { return op | consistency << OP_CONSISTENCY_SHIFT; }
+
+inline int frameConsistency(uint8_t op) { return (op >> OP_CONSISTENCY_SHIFT) & 3; }
+
+// Set the payload length of the frame started at start
+inline void endFrame(std::vector<char> &out, size_t start) {
+    uint32_t length = out.size() - start - sizeof(FrameHeader);
+    memcpy(&out[start] + offsetof(FrameHeader, length), &length, sizeof(length));
+}
+
+inline void appendValue(std::vector<char> &out, const char *value, uint32_t length) {
+    appendField(out, length);
+    out.insert(out.end(), value, value + length);
+}
+
+inline void appendEntry(std::vector<char> &out, uint64_t key, const char *value, uint32_t length, uint64_t version) {
+    StoreEntry entry;
+    entry.key = key;
+    entry.version = version;
+    entry.length = length;
+    appendField(out, entry);
+    out.insert(out.end(), value, value + length);
+}
+
+// Read a field from a payload, moving data past it
+// Return false if the payload ends before the field
+template <typename T>
+inline bool readField(const char *&data, const char *end, T *value) {
+    if (end - data < (long)sizeof(T)) {
+        return false;
+    }
+    memcpy(value, data, sizeof(T));
+    data += sizeof(T);
+    return true;
+}
+
+// Check if a buffer starts with a frame rather than a legacy message
+inline bool isFrame(const char *data, size_t available) {
+    uint16_t magic;
+    if (available < sizeof(magic)) {
+        return false;
+    }
+    memcpy(&magic, data, sizeof(magic));
+    return magic == FRAME_MAGIC;
+}
+
+// Read a length prefixed value, pointing value into the payload
+inline bool readValue(const char *&data, const char *end, const char **value, uint32_t *length) {
+    if (!readField(data, end, length) || (uint32_t)(end - data) < *length) {
+        return false;
+    }
+    *value = data;
+    data += *length;
+    return true;
+}
+
+// Read an entry, pointing value into the payload
+inline bool readEntry(const char *&data, const char *end, StoreEntry *entry, const char **value) {
+    if (!readField(data, end, entry) || (uint64_t)(end - data) < entry->length) {
+        return false;
+    }
+    *value = data;
+    data += entry->length;
+    return true;
+}
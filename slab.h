@@ -0,0 +1,143 @@
+// Slab allocator for store values and index nodes
+//
+// Memory is taken from the system in slabPageSize pages and carved into fixed size chunks. Chunk sizes grow by
+// slabGrowthFactor from slabMinChunk up to a whole page, an allocation gets the smallest chunk it fits in, and a
+// freed chunk goes back to the free list of its class. Pages are never given back, so RSS follows the peak number of
+// chunks per class and a write never waits for a large reallocation, only for a new page now and then.
+//
+// A freed chunk stays mapped: a lock free reader still copying from it reads stale bytes, never unmapped memory,
+// and throws them away when it sees the value changed.
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+#include <vector>
+
+const size_t slabPageSize = 1 << 20;
+const size_t slabMinChunk = 16;
+const double slabGrowthFactor = 1.25;
+
+struct SlabClass {
+    size_t chunkSize = 0;
+    std::mutex lock;
+    // Freed chunks, linked through their first bytes
+    void *free = NULL;
+    // Part of the last page not carved yet
+    char *unused = NULL;
+    size_t unusedLength = 0;
+    size_t pages = 0;
+    size_t chunksUsed = 0;
+    // Bytes asked for by the chunks in use, what is left of their chunks is lost to rounding
+    size_t bytesRequested = 0;
+};
+
+struct SlabAllocator {
+    std::vector<SlabClass> classes;
+
+    SlabAllocator() {
+        std::vector<size_t> sizes;
+        for (double size = slabMinChunk; size < slabPageSize; size *= slabGrowthFactor) {
+            // Chunks stay 8 byte aligned
+            size_t chunkSize = ((size_t)size + 7) & ~(size_t)7;
+            if (sizes.empty() || chunkSize > sizes.back()) {
+                sizes.push_back(chunkSize);
+            }
+        }
+        sizes.push_back(slabPageSize);
+        classes = std::vector<SlabClass>(sizes.size());
+        for (size_t i = 0; i < sizes.size(); i++) {
+            classes[i].chunkSize = sizes[i];
+        }
+    }
+
+    // Class of the smallest chunk holding length bytes, -1 if it does not fit in a page
+    int classOf(size_t length) const {
+        size_t low = 0, high = classes.size();
+        while (low < high) {
+            size_t middle = (low + high) / 2;
+            if (classes[middle].chunkSize < length) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        return low < classes.size() ? (int)low : -1;
+    }
+
+    // Return a chunk of at least length bytes, NULL if length is larger than a page or memory ran out
+    void *allocate(size_t length) {
+        int index = classOf(length);
+        if (index < 0) {
+            return NULL;
+        }
+        SlabClass &slabClass = classes[index];
+        std::lock_guard<std::mutex> guard(slabClass.lock);
+        void *chunk = slabClass.free;
+        if (chunk) {
+            slabClass.free = *(void **)chunk;
+        } else {
+            if (slabClass.unusedLength < slabClass.chunkSize) {
+                char *page = (char *)malloc(slabPageSize);
+                if (!page) {
+                    return NULL;
+                }
+                slabClass.unused = page;
+                slabClass.unusedLength = slabPageSize;
+                slabClass.pages++;
+            }
+            chunk = slabClass.unused;
+            slabClass.unused += slabClass.chunkSize;
+            slabClass.unusedLength -= slabClass.chunkSize;
+        }
+        slabClass.chunksUsed++;
+        slabClass.bytesRequested += length;
+        return chunk;
+    }
+
+    // Give back a chunk returned by allocate(length)
+    void release(void *chunk, size_t length) {
+        if (!chunk) {
+            return;
+        }
+        SlabClass &slabClass = classes[classOf(length)];
+        std::lock_guard<std::mutex> guard(slabClass.lock);
+        *(void **)chunk = slabClass.free;
+        slabClass.free = chunk;
+        slabClass.chunksUsed--;
+        slabClass.bytesRequested -= length;
+    }
+};
+
+// One line per class in use, summed over allocators: chunk size, pages, chunks in use and bytes they hold
+inline std::string slabReport(const std::vector<SlabAllocator *> &allocators) {
+    std::string text;
+    char line[160];
+    size_t totalPages = 0, totalRequested = 0, totalUsed = 0;
+    for (size_t i = 0; !allocators.empty() && i < allocators[0]->classes.size(); i++) {
+        size_t pages = 0, chunksUsed = 0, bytesRequested = 0;
+        for (size_t a = 0; a < allocators.size(); a++) {
+            SlabClass &slabClass = allocators[a]->classes[i];
+            std::lock_guard<std::mutex> guard(slabClass.lock);
+            pages += slabClass.pages;
+            chunksUsed += slabClass.chunksUsed;
+            bytesRequested += slabClass.bytesRequested;
+        }
+        if (!pages) {
+            continue;
+        }
+        size_t chunkSize = allocators[0]->classes[i].chunkSize;
+        snprintf(line, sizeof(line), "slab class %-3d chunk=%-7zu pages=%-5zu chunks=%-9zu requested=%zu bytes\n",
+                 (int)i, chunkSize, pages, chunksUsed, bytesRequested);
+        text += line;
+        totalPages += pages;
+        totalRequested += bytesRequested;
+        totalUsed += chunksUsed * chunkSize;
+    }
+    snprintf(line, sizeof(line), "slab total %zu MB in pages, %zu bytes in chunks, %zu bytes requested\n",
+             totalPages * slabPageSize >> 20, totalUsed, totalRequested);
+    text += line;
+    return text;
+}
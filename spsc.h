@@ -0,0 +1,51 @@
+// Bounded lock free queue for one producer thread and one consumer thread
+//
+// head is only written by the consumer and tail only by the producer, a cache line apart, so the two
+// threads never write the same line and a push or pop is one acquire load and one release store.
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+template <typename T>
+struct SpscQueue {
+    std::vector<T> slots;
+    size_t mask;
+    std::atomic<size_t> head;
+    char padding[64];
+    std::atomic<size_t> tail;
+
+    // capacity is rounded up to a power of two
+    explicit SpscQueue(size_t capacity) : head(0), tail(0) {
+        size_t size = 2;
+        while (size < capacity) {
+            size *= 2;
+        }
+        slots.resize(size);
+        mask = size - 1;
+    }
+
+    // Return false if the queue is full
+    bool push(T &item) {
+        size_t position = tail.load(std::memory_order_relaxed);
+        if (position - head.load(std::memory_order_acquire) > mask) {
+            return false;
+        }
+        slots[position & mask] = std::move(item);
+        tail.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Return false if the queue is empty
+    bool pop(T &item) {
+        size_t position = head.load(std::memory_order_relaxed);
+        if (position == tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        item = std::move(slots[position & mask]);
+        head.store(position + 1, std::memory_order_release);
+        return true;
+    }
+};
@@ -0,0 +1,566 @@
+// Key value store: 64 bit keys, byte string values, each with the version that wrote it
+//
+// The index is a split-ordered hash table: every node sits in one linked list sorted by the bit-reversed hash of
+// its key, and a bucket is a shortcut to the dummy node starting its part of the list. Doubling the bucket count
+// only adds shortcuts, no node ever moves, so the table grows one bucket at a time without a rehash pause. Buckets
+// live in segments allocated on first use, the directory of segments is fixed.
+//
+// Keys are never removed, which keeps the list simple: a node is linked with one compare and swap and readers
+// walk it without locks. The value of a node is guarded by a seqlock, seq is odd while a writer changes it.
+// Values and nodes come from a slab allocator.
+//
+// Next to the list, a B+-tree orders the keys by key for range scans. Only a new key touches it, under orderLock,
+// and a scan holds the lock while it copies a batch of node pointers, then reads their values lock free.
+//
+// A StoreSnapshot is a frozen view of a group of stores, for dumps and scans that must see one point in time while
+// writers carry on. Every put is stamped with the current epoch. Opening a snapshot moves to the next epoch and
+// waits for the puts still running in the one it sees, a put is a few hundred nanoseconds, so the snapshot sees
+// every put of its epoch and older and none after. A put replacing a value an open snapshot can see keeps it in the
+// history of its node instead of freeing it. Histories only grow while snapshots are open and are dropped when the
+// last one closes, so no reader ever walks a freed version.
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "btree.h"
+#include "cluster.h"
+#include "slab.h"
+
+// Buckets per segment and segments in the directory, at 2 keys per bucket this indexes half a billion keys before
+// chains start to grow
+const size_t storeSegmentBuckets = 1 << 14;
+const size_t storeMaxSegments = 1 << 14;
+const size_t storeLoadFactor = 2;
+// Epoch reading the latest value of every key
+const uint64_t storeLatest = UINT64_MAX;
+// Nodes a scan copies out of the ordered index per hold of its lock
+const int storeScanBatch = 64;
+
+// A value a put replaced while an open snapshot could still see it, histories are newest first
+struct StoreVersion {
+    StoreVersion *next;
+    char *value;
+    uint32_t length;
+    uint64_t version;
+    uint64_t epoch;
+};
+
+struct StoreNode {
+    std::atomic<StoreNode *> next;
+    // Bit-reversed hash, the lowest bit is set for keys and clear for bucket dummies so a dummy sorts first
+    uint64_t order;
+    uint64_t key;
+    std::atomic<uint32_t> seq;
+    std::atomic<uint32_t> length;
+    std::atomic<char *> value;
+    std::atomic<uint64_t> version;
+    // Epoch of the put that wrote the value
+    std::atomic<uint64_t> epoch;
+    std::atomic<StoreVersion *> history;
+};
+
+// Snapshot epochs, shared by every store so a snapshot is one cut of all of them
+struct StoreEpochs {
+    std::atomic<uint64_t> current;
+    // Puts running, by parity of the epoch they were stamped with
+    std::atomic<int> writers[2];
+    // Open snapshots and the newest epoch one of them sees
+    std::atomic<int> open;
+    std::atomic<uint64_t> newestOpen;
+    // Serializes opening and closing snapshots
+    std::mutex lock;
+    std::multiset<uint64_t> epochs;
+
+    StoreEpochs() : current(1), open(0), newestOpen(0) {
+        writers[0].store(0);
+        writers[1].store(0);
+    }
+
+    // Stamp a put with the current epoch, a snapshot moving past it waits for endPut
+    uint64_t beginPut() {
+        while (true) {
+            uint64_t epoch = current.load();
+            writers[epoch & 1]++;
+            if (current.load() == epoch) {
+                return epoch;
+            }
+            writers[epoch & 1]--;
+        }
+    }
+
+    void endPut(uint64_t epoch) { writers[epoch & 1]--; }
+
+    // A put of epoch replacing a value written in previousEpoch must keep it if an open snapshot sees it
+    bool mustKeep(uint64_t previousEpoch) const { return open.load() > 0 && previousEpoch <= newestOpen.load(); }
+};
+
+inline StoreEpochs &storeEpochs() {
+    static StoreEpochs epochs;
+    return epochs;
+}
+
+#define PUT_STALE 0
+#define PUT_UPDATED 1
+#define PUT_APPENDED 2
+
+inline uint64_t reverseBits(uint64_t value) {
+    value = ((value >> 1) & 0x5555555555555555ULL) | ((value & 0x5555555555555555ULL) << 1);
+    value = ((value >> 2) & 0x3333333333333333ULL) | ((value & 0x3333333333333333ULL) << 2);
+    value = ((value >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((value & 0x0F0F0F0F0F0F0F0FULL) << 4);
+    return __builtin_bswap64(value);
+}
+
+struct Store {
+    SlabAllocator slabs;
+    std::atomic<std::atomic<StoreNode *> *> segments[storeMaxSegments];
+    std::atomic<size_t> bucketCount;
+    std::atomic<size_t> count;
+    // Nodes with a history, and the versions kept in them
+    std::mutex historyLock;
+    std::vector<StoreNode *> historyNodes;
+    std::atomic<size_t> historyVersions;
+    // Every linked key in key order
+    std::mutex orderLock;
+    BTree<StoreNode *> ordered;
+
+    Store() : bucketCount(2), count(0), historyVersions(0) {
+        for (size_t i = 0; i < storeMaxSegments; i++) {
+            segments[i].store(NULL, std::memory_order_relaxed);
+        }
+        // Bucket 0 heads the whole list, every other bucket can fall back to it
+        StoreNode *head = newNode(0, 0);
+        std::atomic<StoreNode *> *slot = bucketSlot(0);
+        if (!head || !slot) {
+            throw std::bad_alloc();
+        }
+        slot->store(head, std::memory_order_release);
+    }
+
+    // Call fn(key, value, length, version) for every key as it was at epoch, in hash order
+    template <typename Fn>
+    void forEach(Fn fn, uint64_t epoch = storeLatest) {
+        std::string value;
+        for (StoreNode *node = bucketSlot(0)->load(std::memory_order_acquire); node;
+             node = node->next.load(std::memory_order_acquire)) {
+            uint64_t version;
+            if ((node->order & 1) && readAt(node, epoch, &value, &version)) {
+                fn(node->key, value.data(), value.size(), version);
+            }
+        }
+    }
+
+    // Call fn(key, value, length, version) for every key whose hash ends with the low bits bits of hash, as it was
+    // at epoch
+    // Those keys follow each other in the list, right after the dummy of the bucket they share at that many bits
+    template <typename Fn>
+    void forEachWithHashBits(uint64_t hash, int bits, Fn fn, uint64_t epoch = storeLatest) {
+        uint64_t mask = (uint64_t(1) << bits) - 1;
+        uint64_t prefix = reverseBits(hash & mask) >> (64 - bits);
+        std::string value;
+        // The head may be the dummy of a parent bucket, the run of the bucket is then further on
+        StoreNode *node = bucketHead(hash & mask);
+        while (node && node->order >> (64 - bits) < prefix) {
+            node = node->next.load(std::memory_order_acquire);
+        }
+        for (; node && node->order >> (64 - bits) == prefix; node = node->next.load(std::memory_order_acquire)) {
+            uint64_t version;
+            if ((node->order & 1) && readAt(node, epoch, &value, &version)) {
+                fn(node->key, value.data(), value.size(), version);
+            }
+        }
+    }
+
+    // Call fn(key, value, length, version) for the keys from start to end included, in key order, until it returns
+    // false
+    // Return false if fn stopped the scan
+    template <typename Fn>
+    bool scan(uint64_t start, uint64_t end, Fn fn) {
+        StoreNode *batch[storeScanBatch];
+        std::string value;
+        while (start <= end) {
+            int taken = 0;
+            {
+                std::lock_guard<std::mutex> guard(orderLock);
+                int position;
+                for (typename BTree<StoreNode *>::Leaf *leaf = ordered.lowerBound(start, &position);
+                     leaf && taken < storeScanBatch; leaf = leaf->next, position = 0) {
+                    for (; position < leaf->count && taken < storeScanBatch && leaf->keys[position] <= end;
+                         position++) {
+                        batch[taken++] = leaf->values[position];
+                    }
+                    if (position < leaf->count) {
+                        break;
+                    }
+                }
+            }
+            for (int i = 0; i < taken; i++) {
+                uint64_t version;
+                if (read(batch[i], &value, &version) && !fn(batch[i]->key, value.data(), value.size(), version)) {
+                    return false;
+                }
+            }
+            if (taken < storeScanBatch || batch[taken - 1]->key == end) {
+                return true;
+            }
+            start = batch[taken - 1]->key + 1;
+        }
+        return true;
+    }
+
+    // Read the value and version of a key as one consistent pair, return false if the key is not in the store
+    bool get(uint64_t key, std::string *value, uint64_t *version = NULL) {
+        StoreNode *node = find(key);
+        uint64_t nodeVersion;
+        if (!node || !read(node, value, &nodeVersion)) {
+            return false;
+        }
+        if (version) {
+            *version = nodeVersion;
+        }
+        return true;
+    }
+
+    bool contains(uint64_t key) {
+        StoreNode *node = find(key);
+        return node && node->value.load(std::memory_order_acquire);
+    }
+
+    // Put a value, conflicts are resolved by version: the newest one wins
+    // Return PUT_APPENDED for a new key, PUT_UPDATED for a newer version of a key, PUT_STALE if we already have
+    // newer, or -1 if the value does not fit in a slab chunk or memory ran out
+    // replaced is set to the version the put replaced, 0 for a new key
+    int put(uint64_t key, const char *value, uint32_t length, uint64_t version, uint64_t *replaced = NULL) {
+        char *chunk = (char *)slabs.allocate(length ? length : 1);
+        if (!chunk) {
+            return -1;
+        }
+        memcpy(chunk, value, length);
+        bool appended;
+        StoreNode *node = insert(key, &appended);
+        if (!node) {
+            slabs.release(chunk, length ? length : 1);
+            return -1;
+        }
+        StoreEpochs &epochs = storeEpochs();
+        uint64_t epoch = epochs.beginPut();
+        uint32_t seq = lockNode(node);
+        // A node just linked has no value yet, the first writer to take it fills it whatever its version
+        char *previous = node->value.load(std::memory_order_relaxed);
+        uint32_t previousLength = node->length.load(std::memory_order_relaxed);
+        uint64_t previousVersion = node->version.load(std::memory_order_relaxed);
+        if (previous && version <= previousVersion) {
+            node->seq.store(seq + 2, std::memory_order_release);
+            epochs.endPut(epoch);
+            slabs.release(chunk, length ? length : 1);
+            return PUT_STALE;
+        }
+        bool updated = previous != NULL;
+        if (replaced) {
+            *replaced = updated ? previousVersion : 0;
+        }
+        // The replaced value goes to the history if a snapshot may still read it, the history then owns its chunk
+        bool firstVersion = false;
+        if (previous && epochs.mustKeep(node->epoch.load(std::memory_order_relaxed))) {
+            StoreVersion *kept = (StoreVersion *)slabs.allocate(sizeof(StoreVersion));
+            if (!kept) {
+                // The snapshot would lose the value it sees, the put is refused
+                node->seq.store(seq + 2, std::memory_order_release);
+                epochs.endPut(epoch);
+                slabs.release(chunk, length ? length : 1);
+                return -1;
+            }
+            kept->next = node->history.load(std::memory_order_relaxed);
+            kept->value = previous;
+            kept->length = previousLength;
+            kept->version = previousVersion;
+            kept->epoch = node->epoch.load(std::memory_order_relaxed);
+            node->history.store(kept, std::memory_order_relaxed);
+            firstVersion = kept->next == NULL;
+            previous = NULL;
+            historyVersions++;
+        }
+        node->value.store(chunk, std::memory_order_relaxed);
+        node->length.store(length, std::memory_order_relaxed);
+        node->version.store(version, std::memory_order_relaxed);
+        node->epoch.store(epoch, std::memory_order_relaxed);
+        node->seq.store(seq + 2, std::memory_order_release);
+        epochs.endPut(epoch);
+        if (firstVersion) {
+            std::lock_guard<std::mutex> guard(historyLock);
+            historyNodes.push_back(node);
+        }
+        if (previous) {
+            slabs.release(previous, previousLength ? previousLength : 1);
+        }
+        return updated ? PUT_UPDATED : PUT_APPENDED;
+    }
+
+    // Take a node by making its sequence odd, return the even sequence it had
+    uint32_t lockNode(StoreNode *node) {
+        uint32_t seq = node->seq.load(std::memory_order_relaxed);
+        while ((seq & 1) || !node->seq.compare_exchange_weak(seq, seq + 1, std::memory_order_acquire)) {
+            seq = node->seq.load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_release);
+        return seq;
+    }
+
+    // Free every history, only once no snapshot is open
+    void dropHistories() {
+        std::vector<StoreNode *> nodes;
+        {
+            std::lock_guard<std::mutex> guard(historyLock);
+            nodes.swap(historyNodes);
+        }
+        for (size_t i = 0; i < nodes.size(); i++) {
+            uint32_t seq = lockNode(nodes[i]);
+            StoreVersion *kept = nodes[i]->history.exchange(NULL, std::memory_order_relaxed);
+            nodes[i]->seq.store(seq + 2, std::memory_order_release);
+            while (kept) {
+                StoreVersion *next = kept->next;
+                slabs.release(kept->value, kept->length ? kept->length : 1);
+                slabs.release(kept, sizeof(StoreVersion));
+                historyVersions--;
+                kept = next;
+            }
+        }
+    }
+
+    // Slot of a bucket, NULL if its segment is new and memory ran out
+    std::atomic<StoreNode *> *bucketSlot(size_t bucket) {
+        std::atomic<StoreNode *> *segment = segments[bucket / storeSegmentBuckets].load(std::memory_order_acquire);
+        if (!segment) {
+            // Zeroed memory is a segment of null buckets
+            std::atomic<StoreNode *> *created =
+                (std::atomic<StoreNode *> *)calloc(storeSegmentBuckets, sizeof(std::atomic<StoreNode *>));
+            if (!created) {
+                return NULL;
+            }
+            if (segments[bucket / storeSegmentBuckets].compare_exchange_strong(segment, created)) {
+                segment = created;
+            } else {
+                free(created);
+            }
+        }
+        return &segment[bucket % storeSegmentBuckets];
+    }
+
+    // Return NULL if memory ran out
+    StoreNode *newNode(uint64_t order, uint64_t key) {
+        StoreNode *node = (StoreNode *)slabs.allocate(sizeof(StoreNode));
+        if (!node) {
+            return NULL;
+        }
+        node->next.store(NULL, std::memory_order_relaxed);
+        node->order = order;
+        node->key = key;
+        node->seq.store(0, std::memory_order_relaxed);
+        node->length.store(0, std::memory_order_relaxed);
+        node->value.store(NULL, std::memory_order_relaxed);
+        node->version.store(0, std::memory_order_relaxed);
+        node->epoch.store(0, std::memory_order_relaxed);
+        node->history.store(NULL, std::memory_order_relaxed);
+        return node;
+    }
+
+    // Dummy node of a bucket, created the first time the bucket is used by splitting it from its parent bucket
+    // Out of memory the dummy of a parent bucket is returned, it comes before every key of the bucket too
+    StoreNode *bucketHead(size_t bucket) {
+        std::atomic<StoreNode *> *slot = bucketSlot(bucket);
+        StoreNode *head = slot ? slot->load(std::memory_order_acquire) : NULL;
+        if (head) {
+            return head;
+        }
+        // The parent is the bucket without the highest bit set, the dummy goes in its part of the list
+        size_t parent = bucket & ~(size_t(1) << (63 - __builtin_clzll(bucket)));
+        bool created;
+        StoreNode *parentHead = bucketHead(parent);
+        head = slot ? link(parentHead, reverseBits(bucket), 0, &created) : NULL;
+        if (!head) {
+            return parentHead;
+        }
+        slot->store(head, std::memory_order_release);
+        return head;
+    }
+
+    // Find the node of (order, key) after start, or link a new one where it belongs
+    // Return NULL if a new one was needed and memory ran out
+    StoreNode *link(StoreNode *start, uint64_t order, uint64_t key, bool *created) {
+        StoreNode *node = NULL;
+        while (true) {
+            StoreNode *previous = start;
+            StoreNode *current = previous->next.load(std::memory_order_acquire);
+            while (current && (current->order < order || (current->order == order && current->key < key))) {
+                previous = current;
+                current = current->next.load(std::memory_order_acquire);
+            }
+            if (current && current->order == order && current->key == key) {
+                // Someone linked it first, give our node back
+                if (node) {
+                    slabs.release(node, sizeof(StoreNode));
+                }
+                *created = false;
+                return current;
+            }
+            if (!node) {
+                node = newNode(order, key);
+                if (!node) {
+                    *created = false;
+                    return NULL;
+                }
+            }
+            node->next.store(current, std::memory_order_relaxed);
+            if (previous->next.compare_exchange_strong(current, node, std::memory_order_release)) {
+                *created = true;
+                return node;
+            }
+        }
+    }
+
+    StoreNode *find(uint64_t key) {
+        uint64_t hash = ringHash(key);
+        uint64_t order = reverseBits(hash) | 1;
+        StoreNode *node = bucketHead(hash & (bucketCount.load(std::memory_order_acquire) - 1));
+        while (node && (node->order < order || (node->order == order && node->key < key))) {
+            node = node->next.load(std::memory_order_acquire);
+        }
+        return node && node->order == order && node->key == key ? node : NULL;
+    }
+
+    // Node of a key, linked if it is new, NULL if memory ran out
+    StoreNode *insert(uint64_t key, bool *appended) {
+        uint64_t hash = ringHash(key);
+        size_t buckets = bucketCount.load(std::memory_order_acquire);
+        StoreNode *node = link(bucketHead(hash & (buckets - 1)), reverseBits(hash) | 1, key, appended);
+        if (!node) {
+            return NULL;
+        }
+        if (*appended) {
+            std::lock_guard<std::mutex> guard(orderLock);
+            ordered.insert(key, node);
+        }
+        if (*appended && ++count > buckets * storeLoadFactor && buckets < storeSegmentBuckets * storeMaxSegments) {
+            // Double the buckets, the new ones are split from their parents the first time they are used
+            bucketCount.compare_exchange_strong(buckets, buckets * 2);
+        }
+        return node;
+    }
+
+    // Copy the value of a node, lock free: retry while a writer holds it
+    // Return false if the node was just linked and has no value yet
+    bool read(StoreNode *node, std::string *value, uint64_t *version) {
+        while (true) {
+            uint32_t seq = node->seq.load(std::memory_order_acquire);
+            if (seq & 1) {
+                continue;
+            }
+            char *data = node->value.load(std::memory_order_relaxed);
+            uint32_t length = node->length.load(std::memory_order_relaxed);
+            *version = node->version.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (node->seq.load(std::memory_order_relaxed) != seq) {
+                continue;
+            }
+            if (!data) {
+                return false;
+            }
+            // data and length belong together, the chunk may be reused while we copy but stays mapped
+            value->assign(data, length);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (node->seq.load(std::memory_order_relaxed) == seq) {
+                return true;
+            }
+        }
+    }
+
+    // Copy the value a node had at epoch, from its history if a later put replaced it
+    // Return false if the key had no value yet at epoch
+    bool readAt(StoreNode *node, uint64_t epoch, std::string *value, uint64_t *version) {
+        if (epoch == storeLatest) {
+            return read(node, value, version);
+        }
+        while (true) {
+            uint32_t seq = node->seq.load(std::memory_order_acquire);
+            if (seq & 1) {
+                continue;
+            }
+            uint64_t nodeEpoch = node->epoch.load(std::memory_order_relaxed);
+            StoreVersion *kept = node->history.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (node->seq.load(std::memory_order_relaxed) != seq) {
+                continue;
+            }
+            if (nodeEpoch <= epoch) {
+                // The value is the one the snapshot sees, unless a put replaces it meanwhile: then look again
+                uint64_t nodeVersion;
+                if (!read(node, value, &nodeVersion)) {
+                    return false;
+                }
+                if (node->epoch.load(std::memory_order_acquire) <= epoch) {
+                    *version = nodeVersion;
+                    return true;
+                }
+                continue;
+            }
+            // Kept versions are never freed while a snapshot is open
+            for (; kept; kept = kept->next) {
+                if (kept->epoch <= epoch) {
+                    value->assign(kept->value, kept->length);
+                    *version = kept->version;
+                    return true;
+                }
+            }
+            return false;
+        }
+    }
+};
+
+// Frozen view of a group of stores, open for the life of the object
+struct StoreSnapshot {
+    std::vector<Store *> stores;
+    // Puts of this epoch and older are seen
+    uint64_t epoch;
+
+    explicit StoreSnapshot(const std::vector<Store *> &snapshotStores) : stores(snapshotStores) {
+        StoreEpochs &epochs = storeEpochs();
+        std::lock_guard<std::mutex> guard(epochs.lock);
+        epoch = epochs.current.load();
+        epochs.epochs.insert(epoch);
+        epochs.newestOpen.store(epoch);
+        epochs.open++;
+        // Puts starting from now get the next epoch and keep what we see, the ones already running finish first
+        epochs.current.store(epoch + 1);
+        while (epochs.writers[epoch & 1].load() > 0) {
+            std::this_thread::yield();
+        }
+    }
+
+    ~StoreSnapshot() {
+        StoreEpochs &epochs = storeEpochs();
+        std::lock_guard<std::mutex> guard(epochs.lock);
+        epochs.epochs.erase(epochs.epochs.find(epoch));
+        epochs.newestOpen.store(epochs.epochs.empty() ? 0 : *epochs.epochs.rbegin());
+        if (--epochs.open == 0) {
+            for (size_t i = 0; i < stores.size(); i++) {
+                stores[i]->dropHistories();
+            }
+        }
+    }
+
+    // Call fn(key, value, length, version) for every key of every store as it was when the snapshot opened
+    template <typename Fn>
+    void forEach(Fn fn) {
+        for (size_t i = 0; i < stores.size(); i++) {
+            stores[i]->forEach(fn, epoch);
+        }
+    }
+};